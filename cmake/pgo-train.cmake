@@ -0,0 +1,41 @@
+# Training workload for RISC_PGO=generate builds, run through the pgo-train
+# target. Everything a run prints is thrown away, only the profiles matter.
+
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+function(train)
+	execute_process(COMMAND ${ARGN}
+		WORKING_DIRECTORY "${WORK_DIR}"
+		INPUT_FILE "${WORK_DIR}/console.txt"
+		OUTPUT_FILE "${WORK_DIR}/train.log"
+		ERROR_FILE "${WORK_DIR}/train.log"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "Training run failed (${result}): ${ARGN}")
+	endif()
+endfunction()
+
+# The debug console reads its commands from stdin
+file(WRITE "${WORK_DIR}/console.txt" "s 2000000\nq\n")
+
+set(image "${SOURCE_DIR}/risc-emulator/fake_memory_init.bin")
+
+train("${BENCHMARK}" -reps 1 -scale 0.5 -format csv)
+train("${EMULATOR}" -i "${image}" -bp gshare)
+train("${EMULATOR}" -i "${image}" -debug 1)
+train("${COMPILER}" -i "${SOURCE_DIR}/risc-compiler/hello.asm" -o "${WORK_DIR}/hello.bin")
+train("${COMPILER}" -i "${SOURCE_DIR}/risc-compiler/hello.asm" -o "${WORK_DIR}/hello.c.bin" -march rv32ic)
+
+if(CLANG)
+	if(NOT LLVM_PROFDATA)
+		message(FATAL_ERROR "llvm-profdata is needed to merge clang profiles")
+	endif()
+	file(GLOB raw_profiles "${PROFILE_DIR}/*.profraw")
+	execute_process(COMMAND "${LLVM_PROFDATA}" merge -output=${PROFILE_DIR}/merged.profdata ${raw_profiles}
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "llvm-profdata merge failed")
+	endif()
+endif()
+
+message(STATUS "Profiles written to ${PROFILE_DIR}, reconfigure with -DRISC_PGO=use and rebuild")
@@ -0,0 +1,460 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include "../risc-emulator/cpu_risc32i.h"
+#include "../risc-emulator/arguments.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// Tiny RV32I assembler over isa::encode for the kernel corpus, with labels so loops and calls can
+// be written forwards. A zero word ends the program (the cpu stalls on it).
+class program_builder {
+public:
+	enum reg : uint32_t { zero = 0, ra = 1, sp = 2, t0 = 5, t1 = 6, t2 = 7, s0 = 8, s1 = 9, a0 = 10, a1 = 11, a2 = 12, a3 = 13, a4 = 14, a5 = 15 };
+
+	void emit(isa::mnemonic id, uint32_t rd, uint32_t rs1, uint32_t rs2, int32_t imm) {
+		code.push_back(isa::encode(id, rd, rs1, rs2, imm));
+	}
+
+	void add(uint32_t rd, uint32_t rs1, uint32_t rs2) { emit(isa::mnemonic::add, rd, rs1, rs2, 0); }
+	void sub(uint32_t rd, uint32_t rs1, uint32_t rs2) { emit(isa::mnemonic::sub, rd, rs1, rs2, 0); }
+	void sll(uint32_t rd, uint32_t rs1, uint32_t rs2) { emit(isa::mnemonic::sll, rd, rs1, rs2, 0); }
+	void slt(uint32_t rd, uint32_t rs1, uint32_t rs2) { emit(isa::mnemonic::slt, rd, rs1, rs2, 0); }
+	void xor_(uint32_t rd, uint32_t rs1, uint32_t rs2) { emit(isa::mnemonic::xor_, rd, rs1, rs2, 0); }
+	void srl(uint32_t rd, uint32_t rs1, uint32_t rs2) { emit(isa::mnemonic::srl, rd, rs1, rs2, 0); }
+	void or_(uint32_t rd, uint32_t rs1, uint32_t rs2) { emit(isa::mnemonic::or_, rd, rs1, rs2, 0); }
+	void and_(uint32_t rd, uint32_t rs1, uint32_t rs2) { emit(isa::mnemonic::and_, rd, rs1, rs2, 0); }
+	void addi(uint32_t rd, uint32_t rs1, int32_t imm) { emit(isa::mnemonic::addi, rd, rs1, 0, imm); }
+	void andi(uint32_t rd, uint32_t rs1, int32_t imm) { emit(isa::mnemonic::andi, rd, rs1, 0, imm); }
+	void slli(uint32_t rd, uint32_t rs1, uint32_t shamt) { emit(isa::mnemonic::slli, rd, rs1, 0, shamt); }
+	void srli(uint32_t rd, uint32_t rs1, uint32_t shamt) { emit(isa::mnemonic::srli, rd, rs1, 0, shamt); }
+	void lw(uint32_t rd, uint32_t rs1, int32_t imm) { emit(isa::mnemonic::lw, rd, rs1, 0, imm); }
+	void sw(uint32_t rs2, uint32_t rs1, int32_t imm) { emit(isa::mnemonic::sw, 0, rs1, rs2, imm); }
+	void jalr(uint32_t rd, uint32_t rs1, int32_t imm) { emit(isa::mnemonic::jalr, rd, rs1, 0, imm); }
+	void ret() { jalr(zero, ra, 0); }
+
+	void li(uint32_t rd, int32_t value) {
+		int32_t upper = int32_t((uint32_t(value) + 0x800) & 0xfffff000);
+		if (upper) {
+			emit(isa::mnemonic::lui, rd, 0, 0, upper);
+			addi(rd, rd, value - upper);
+		}
+		else addi(rd, zero, value);
+	}
+
+	void beq(uint32_t rs1, uint32_t rs2, const std::string& target) { branch(isa::mnemonic::beq, rs1, rs2, target); }
+	void bne(uint32_t rs1, uint32_t rs2, const std::string& target) { branch(isa::mnemonic::bne, rs1, rs2, target); }
+	void blt(uint32_t rs1, uint32_t rs2, const std::string& target) { branch(isa::mnemonic::blt, rs1, rs2, target); }
+	void jal(uint32_t rd, const std::string& target) {
+		fixups.push_back({ code.size(), target, true });
+		emit(isa::mnemonic::jal, rd, 0, 0, 0);
+	}
+
+	void label(const std::string& name) { labels[name] = uint32_t(code.size() * 4); }
+	void halt() { code.push_back(0); }
+
+	std::vector<uint32_t> finish() {
+		for (auto& fixup : fixups) {
+			auto it = labels.find(fixup.target);
+			if (it == labels.end())
+				throw std::runtime_error("Unknown label '" + fixup.target + "'");
+			int32_t offset = int32_t(it->second - uint32_t(fixup.index * 4));
+			uint32_t& word = code[fixup.index];
+			word = fixup.jump ? isa::with_immediate<isa::format::j>(word, offset) : isa::with_immediate<isa::format::b>(word, offset);
+		}
+		return code;
+	}
+
+private:
+	struct fixup {
+		size_t index;
+		std::string target;
+		bool jump;
+	};
+
+	void branch(isa::mnemonic id, uint32_t rs1, uint32_t rs2, const std::string& target) {
+		fixups.push_back({ code.size(), target, false });
+		emit(id, 0, rs1, rs2, 0);
+	}
+
+	std::vector<uint32_t> code;
+	std::vector<fixup> fixups;
+	std::map<std::string, uint32_t> labels;
+};
+
+using P = program_builder;
+
+// Register-only arithmetic, roughly 14 instructions per iteration.
+std::vector<uint32_t> alu_kernel(int32_t iterations) {
+	P p;
+	p.li(P::t0, iterations);
+	p.li(P::t1, 0x12345);
+	p.li(P::t2, 0x6789a);
+	p.label("loop");
+	p.add(P::s0, P::t1, P::t2);
+	p.xor_(P::s1, P::s0, P::t1);
+	p.andi(P::a2, P::t2, 31);
+	p.sll(P::a0, P::s1, P::a2);
+	p.srl(P::a1, P::s0, P::a2);
+	p.or_(P::a3, P::a0, P::a1);
+	p.and_(P::a4, P::a3, P::t1);
+	p.sub(P::a5, P::a3, P::a4);
+	p.slt(P::a2, P::a5, P::s0);
+	p.add(P::t1, P::t1, P::a5);
+	p.addi(P::t2, P::t2, 3);
+	p.addi(P::t0, P::t0, -1);
+	p.bne(P::t0, P::zero, "loop");
+	p.halt();
+	return p.finish();
+}
+
+// Copies a 1024 word block over and over, unrolled by two.
+std::vector<uint32_t> memcpy_kernel(int32_t iterations) {
+	P p;
+	p.li(P::t0, iterations);
+	p.label("outer");
+	p.li(P::t1, 0x10000);
+	p.li(P::t2, 0x20000);
+	p.li(P::s0, 1024);
+	p.label("inner");
+	p.lw(P::a0, P::t1, 0);
+	p.lw(P::a1, P::t1, 4);
+	p.sw(P::a0, P::t2, 0);
+	p.sw(P::a1, P::t2, 4);
+	p.addi(P::t1, P::t1, 8);
+	p.addi(P::t2, P::t2, 8);
+	p.addi(P::s0, P::s0, -2);
+	p.bne(P::s0, P::zero, "inner");
+	p.addi(P::t0, P::t0, -1);
+	p.bne(P::t0, P::zero, "outer");
+	p.halt();
+	return p.finish();
+}
+
+// Three branches per iteration on the bits of a xorshift sequence, so the
+// directions are close to random.
+std::vector<uint32_t> branchy_kernel(int32_t iterations) {
+	P p;
+	p.li(P::t0, iterations);
+	p.li(P::t1, 0x2545f491);
+	p.label("loop");
+	p.slli(P::t2, P::t1, 13);
+	p.xor_(P::t1, P::t1, P::t2);
+	p.srli(P::t2, P::t1, 17);
+	p.xor_(P::t1, P::t1, P::t2);
+	p.slli(P::t2, P::t1, 5);
+	p.xor_(P::t1, P::t1, P::t2);
+	p.andi(P::t2, P::t1, 1);
+	p.beq(P::t2, P::zero, "skip1");
+	p.addi(P::a0, P::a0, 1);
+	p.label("skip1");
+	p.andi(P::t2, P::t1, 2);
+	p.bne(P::t2, P::zero, "skip2");
+	p.addi(P::a1, P::a1, 1);
+	p.label("skip2");
+	p.blt(P::t1, P::zero, "skip3");
+	p.addi(P::a2, P::a2, 1);
+	p.label("skip3");
+	p.addi(P::t0, P::t0, -1);
+	p.bne(P::t0, P::zero, "loop");
+	p.halt();
+	return p.finish();
+}
+
+// Two levels of calls per iteration, the outer one saving ra and s0 on the stack.
+std::vector<uint32_t> call_kernel(int32_t iterations) {
+	P p;
+	p.li(P::t0, iterations);
+	p.label("loop");
+	p.jal(P::ra, "outer");
+	p.addi(P::t0, P::t0, -1);
+	p.bne(P::t0, P::zero, "loop");
+	p.halt();
+
+	p.label("outer");
+	p.addi(P::sp, P::sp, -8);
+	p.sw(P::ra, P::sp, 4);
+	p.sw(P::s0, P::sp, 0);
+	p.addi(P::s0, P::t0, 1);
+	p.jal(P::ra, "leaf");
+	p.add(P::a0, P::a0, P::s0);
+	p.lw(P::s0, P::sp, 0);
+	p.lw(P::ra, P::sp, 4);
+	p.addi(P::sp, P::sp, 8);
+	p.ret();
+
+	p.label("leaf");
+	p.xor_(P::a0, P::a0, P::t0);
+	p.addi(P::a1, P::a1, 1);
+	p.ret();
+	return p.finish();
+}
+
+struct kernel {
+	const char* name;
+	std::function<std::vector<uint32_t>(int32_t)> build;
+	int32_t iterations; // at -scale 1, a few million instructions each
+};
+
+static const kernel kernels[] = {
+	{ "alu", alu_kernel, 400000 },
+	{ "memcpy", memcpy_kernel, 1000 },
+	{ "branchy", branchy_kernel, 300000 },
+	{ "calls", call_kernel, 350000 },
+};
+
+// What is attached to the cpu while it runs. Every hook is a pointer test on
+// the hot path when detached, so "base" against the rest shows their cost.
+struct configuration {
+	const char* name;
+	std::unique_ptr<branch_model> branchModel;
+	std::unique_ptr<time_travel> timeTravel;
+	std::unique_ptr<watchpoint_set> watchpoints;
+
+	void attach(cpu_risc32i& cpu) {
+		cpu.branchModel = branchModel.get();
+		cpu.timeTravel = timeTravel.get();
+		cpu.watchpoints = watchpoints.get();
+	}
+};
+
+configuration make_configuration(const std::string& name) {
+	configuration config{};
+	if (name == "base") config.name = "base";
+	else if (name == "bpred") {
+		config.name = "bpred";
+		config.branchModel = branch_model::create("gshare", 12, 16, 2);
+	}
+	else if (name == "history") {
+		config.name = "history";
+		config.timeTravel = std::make_unique<time_travel>();
+	}
+	else if (name == "watch") {
+		// armed on a page none of the kernels store to, the cost of the page check
+		config.name = "watch";
+		config.watchpoints = std::make_unique<watchpoint_set>();
+		config.watchpoints->insert(0x3f000, 16);
+	}
+	else throw std::runtime_error("Unknown configuration '" + name + "' (base, bpred, history, watch are valid)");
+	return config;
+}
+
+// Resident set of the whole process, in KB.
+uint64_t resident_kb() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters{};
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.WorkingSetSize / 1024;
+#else
+	std::ifstream statm("/proc/self/statm");
+	uint64_t size = 0, resident = 0;
+	if (statm >> size >> resident)
+		return resident * uint64_t(sysconf(_SC_PAGESIZE)) / 1024;
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	return uint64_t(usage.ru_maxrss); // peak rather than current, but better than nothing
+#endif
+}
+
+struct result {
+	std::string kernel;
+	std::string config;
+	uint64_t instructions = 0;
+	double seconds = 0;
+	double mips = 0;
+	double ns_per_instruction = 0;
+	uint64_t guest_kb = 0;
+	uint64_t resident_kb = 0;
+	uint32_t checksum = 0;	// of the final register file, catches engines that disagree
+};
+
+result run(const kernel& k, const std::string& config_name, double scale, uint32_t repetitions, uint32_t memory_words) {
+	auto program = k.build(std::max<int32_t>(1, int32_t(k.iterations * scale)));
+
+	result best;
+	best.kernel = k.name;
+	best.config = config_name;
+	for (uint32_t rep = 0; rep <= repetitions; rep++) {
+		configuration config = make_configuration(config_name);
+		cpu_risc32i cpu(memory_words);
+		cpu.load_program(0, program);
+		config.attach(cpu);
+
+		auto start = std::chrono::steady_clock::now();
+		while (cpu.step()) {}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		uint32_t checksum = 2166136261u;
+		for (int i = 0; i < 32; i++)
+			checksum = (checksum ^ uint32_t(cpu.registers.REG[i])) * 16777619u;
+
+		// the first pass only warms caches and the allocator
+		if (rep == 0 || (best.seconds && seconds >= best.seconds)) continue;
+		best.instructions = cpu.fetchStats.instructions;
+		best.seconds = seconds;
+		best.mips = seconds > 0 ? best.instructions / seconds / 1e6 : 0;
+		best.ns_per_instruction = best.instructions ? seconds * 1e9 / best.instructions : 0;
+		best.guest_kb = (cpu.program_memory().capacity() + cpu.data_memory().capacity()) * sizeof(uint32_t) / 1024;
+		best.resident_kb = resident_kb();
+		best.checksum = checksum;
+	}
+	return best;
+}
+
+void write_csv(std::ostream& out, const std::vector<result>& results) {
+	out << "kernel,config,instructions,seconds,mips,ns_per_instr,guest_kb,resident_kb,checksum\n";
+	char line[256];
+	for (auto& r : results) {
+		snprintf(line, sizeof(line), "%s,%s,%llu,%.6f,%.3f,%.3f,%llu,%llu,%08x\n", r.kernel.c_str(), r.config.c_str(),
+			(unsigned long long)r.instructions, r.seconds, r.mips, r.ns_per_instruction,
+			(unsigned long long)r.guest_kb, (unsigned long long)r.resident_kb, r.checksum);
+		out << line;
+	}
+}
+
+void write_json(std::ostream& out, const std::vector<result>& results) {
+	char line[320];
+	out << "[\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		auto& r = results[i];
+		snprintf(line, sizeof(line), "  {\"kernel\": \"%s\", \"config\": \"%s\", \"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.3f, "
+			"\"ns_per_instr\": %.3f, \"guest_kb\": %llu, \"resident_kb\": %llu, \"checksum\": \"%08x\"}%s\n",
+			r.kernel.c_str(), r.config.c_str(), (unsigned long long)r.instructions, r.seconds, r.mips, r.ns_per_instruction,
+			(unsigned long long)r.guest_kb, (unsigned long long)r.resident_kb, r.checksum, i + 1 < results.size() ? "," : "");
+		out << line;
+	}
+	out << "]\n";
+}
+
+void write_table(FILE* out, const std::vector<result>& results) {
+	fprintf(out, "%-8s  %-8s  %12s  %10s  %10s  %9s  %11s  %8s\n", "kernel", "config", "instructions", "MIPS", "ns/instr", "guest KB", "resident KB", "checksum");
+	for (auto& r : results)
+		fprintf(out, "%-8s  %-8s  %12llu  %10.2f  %10.3f  %9llu  %11llu  %08x\n", r.kernel.c_str(), r.config.c_str(), (unsigned long long)r.instructions,
+			r.mips, r.ns_per_instruction, (unsigned long long)r.guest_kb, (unsigned long long)r.resident_kb, r.checksum);
+}
+
+std::vector<result> read_csv(const std::string& path) {
+	std::ifstream in(path);
+	if (!in)
+		throw std::runtime_error("Cannot open baseline '" + path + "'");
+	std::vector<result> results;
+	std::string line;
+	std::getline(in, line); // header
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		std::string field[9];
+		for (auto& f : field) std::getline(fields, f, ',');
+		if (field[8].empty()) continue;
+		result r;
+		r.kernel = field[0];
+		r.config = field[1];
+		r.instructions = std::stoull(field[2]);
+		r.seconds = std::stod(field[3]);
+		r.mips = std::stod(field[4]);
+		r.ns_per_instruction = std::stod(field[5]);
+		r.guest_kb = std::stoull(field[6]);
+		r.resident_kb = std::stoull(field[7]);
+		r.checksum = std::stoul(field[8], nullptr, 16);
+		results.push_back(r);
+	}
+	return results;
+}
+
+// Returns the number of regressions: a throughput drop beyond the threshold,
+// or a kernel that no longer computes the same thing.
+int compare(FILE* out, const std::vector<result>& results, const std::vector<result>& baseline, double threshold) {
+	int regressions = 0;
+	fprintf(out, "\n%-8s  %-8s  %10s  %10s  %8s\n", "kernel", "config", "base MIPS", "MIPS", "change");
+	for (auto& r : results) {
+		auto it = std::find_if(baseline.begin(), baseline.end(), [&](const result& b) { return b.kernel == r.kernel && b.config == r.config; });
+		if (it == baseline.end()) {
+			fprintf(out, "%-8s  %-8s  %10s  %10.2f  %8s\n", r.kernel.c_str(), r.config.c_str(), "-", r.mips, "new");
+			continue;
+		}
+		double change = it->mips > 0 ? 100.0 * (r.mips - it->mips) / it->mips : 0;
+		const char* verdict = "";
+		if (it->checksum != r.checksum || it->instructions != r.instructions) verdict = "  MISMATCH";
+		else if (change < -threshold) verdict = "  REGRESSION";
+		regressions += *verdict != 0;
+		fprintf(out, "%-8s  %-8s  %10.2f  %10.2f  %+7.1f%%%s\n", r.kernel.c_str(), r.config.c_str(), it->mips, r.mips, change, verdict);
+	}
+	return regressions;
+}
+
+int main(int argc, char** argv) {
+
+	auto args = ProccessArguments(argc, argv, {
+		std::make_pair("-kernels", ArgOpt{std::string("alu,memcpy,branchy,calls")}),
+		std::make_pair("-configs", ArgOpt{std::string("base,bpred,history,watch")}),
+		std::make_pair("-scale", ArgOpt{std::string("1")}),				// multiplies every kernel's iteration count
+		std::make_pair("-reps", ArgOpt{std::string("3")}),				// timed runs per kernel, the fastest is kept
+		std::make_pair("-mem", ArgOpt{std::string("262144")}),			// words of guest memory, as the emulator uses
+		std::make_pair("-format", ArgOpt{std::string("table")}),		// table, csv, json (written to stdout)
+		std::make_pair("-save", ArgOpt{}),								// write the results as a csv baseline
+		std::make_pair("-baseline", ArgOpt{}),							// csv from -save to compare against
+		std::make_pair("-threshold", ArgOpt{std::string("5")}),			// percent MIPS drop counted as a regression
+	});
+
+	auto split = [](const std::string& list) {
+		std::vector<std::string> items;
+		std::istringstream iss(list);
+		for (std::string item; std::getline(iss, item, ',');)
+			if (!item.empty()) items.push_back(item);
+		return items;
+	};
+
+	std::vector<result> results;
+	try {
+		for (auto& kernel_name : split(args["-kernels"])) {
+			auto k = std::find_if(std::begin(kernels), std::end(kernels), [&](const kernel& k) { return kernel_name == k.name; });
+			if (k == std::end(kernels))
+				throw std::runtime_error("Unknown kernel '" + kernel_name + "' (alu, memcpy, branchy, calls are valid)");
+			for (auto& config_name : split(args["-configs"])) {
+				results.push_back(run(*k, config_name, std::stod(args["-scale"]), std::max(1u, uint32_t(std::stoul(args["-reps"]))), std::stoul(args["-mem"])));
+				if (args["-format"] == "table")
+					fprintf(stderr, "%s/%s done\n", kernel_name.c_str(), config_name.c_str());
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "ERROR: %s\n", e.what());
+		return 2;
+	}
+
+	if (args["-format"] == "csv") write_csv(std::cout, results);
+	else if (args["-format"] == "json") write_json(std::cout, results);
+	else write_table(stdout, results);
+	std::cout.flush();
+
+	if (!args["-save"].empty()) {
+		std::ofstream out(args["-save"]);
+		write_csv(out, results);
+	}
+
+	if (!args["-baseline"].empty()) {
+		try {
+			int regressions = compare(stderr, results, read_csv(args["-baseline"]), std::stod(args["-threshold"]));
+			fprintf(stderr, "%d regression(s) against %s\n", regressions, args["-baseline"].c_str());
+			return regressions ? 1 : 0;
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "ERROR: %s\n", e.what());
+			return 2;
+		}
+	}
+	return 0;
+}
@@ -3,10 +3,12 @@
 #include <string>
 #include <optional>
 #include <vector>
-#include <format>
 #include <map>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include "../risc-emulator/isa.h"
 using namespace std;
 
 struct ArgOpt {
@@ -130,176 +132,13 @@ uint32_t ParseRegister(const string& regText, int line) {
 	return -1;
 }
 
-uint32_t GetInstructionFunct3(const string& instructionName, int line) {
-	if (instructionName == "lui") return 0b000;
-	if (instructionName == "auipc") return 0b000;
-	if (instructionName == "jal") return 0b000;
-	if (instructionName == "jalr") return 0b000;
-	if (instructionName == "beq") return 0b000;
-	if (instructionName == "bne") return 0b001;
-	if (instructionName == "blt") return 0b100;
-	if (instructionName == "bge") return 0b101;
-	if (instructionName == "bltu") return 0b110;
-	if (instructionName == "bgeu") return 0b111;
-	if (instructionName == "lb") return 0b000;
-	if (instructionName == "lh") return 0b001;
-	if (instructionName == "lw") return 0b010;
-	if (instructionName == "lbu") return 0b100;
-	if (instructionName == "lhu") return 0b101;
-	if (instructionName == "sb") return 0b000;
-	if (instructionName == "sh") return 0b001;
-	if (instructionName == "sw") return 0b010;
-	if (instructionName == "addi") return 0b000;
-	if (instructionName == "slti") return 0b010;
-	if (instructionName == "sltiu") return 0b011;
-	if (instructionName == "xori") return 0b100;
-	if (instructionName == "ori") return 0b110;
-	if (instructionName == "andi") return 0b111;
-	if (instructionName == "slli") return 0b001;
-	if (instructionName == "srli") return 0b101;
-	if (instructionName == "srai") return 0b101;
-	if (instructionName == "add") return 0b000;
-	if (instructionName == "sub") return 0b000;
-	if (instructionName == "sll") return 0b001;
-	if (instructionName == "slt") return 0b010;
-	if (instructionName == "sltu") return 0b011;
-	if (instructionName == "xor") return 0b100;
-	if (instructionName == "srl") return 0b101;
-	if (instructionName == "sra") return 0b101;
-	if (instructionName == "or") return 0b110;
-	if (instructionName == "and") return 0b111;
+// Every mnemonic the assembler knows, and its encoding, comes from the ISA
+// table the emulator decodes with.
+const isa::instruction& GetInstruction(const string& instructionName, int line) {
+	if (auto row = isa::find(instructionName))
+		return *row;
 	cerr << "ERROR: Unknown opcode encountered '" << instructionName << "' at line " << line << "\n\n";
 	exit(0);
-	return -1;
-}
-
-uint32_t GetInstructionFunct7(const string& instructionName, int line) {
-	if (instructionName == "lui") return 0;
-	if (instructionName == "auipc") return 0;
-	if (instructionName == "jal") return 0;
-	if (instructionName == "jalr") return 0;
-	if (instructionName == "beq") return 0;
-	if (instructionName == "bne") return 0;
-	if (instructionName == "blt") return 0;
-	if (instructionName == "bge") return 0;
-	if (instructionName == "bltu") return 0;
-	if (instructionName == "bgeu") return 0;
-	if (instructionName == "lb") return 0;
-	if (instructionName == "lh") return 0;
-	if (instructionName == "lw") return 0;
-	if (instructionName == "lbu") return 0;
-	if (instructionName == "lhu") return 0;
-	if (instructionName == "sb") return 0;
-	if (instructionName == "sh") return 0;
-	if (instructionName == "sw") return 0;
-	if (instructionName == "addi") return 0;
-	if (instructionName == "slti") return 0;
-	if (instructionName == "sltiu") return 0;
-	if (instructionName == "xori") return 0;
-	if (instructionName == "ori") return 0;
-	if (instructionName == "andi") return 0;
-	if (instructionName == "slli") return 0b0000000;
-	if (instructionName == "srli") return 0b0000000;
-	if (instructionName == "srai") return 0b0100000;
-	if (instructionName == "add") return 0b0000000;
-	if (instructionName == "sub") return 0b0100000;
-	if (instructionName == "sll") return 0b0000000;
-	if (instructionName == "slt") return 0b0000000;
-	if (instructionName == "sltu") return 0b0000000;
-	if (instructionName == "xor") return 0b0000000;
-	if (instructionName == "srl") return 0b0000000;
-	if (instructionName == "sra") return 0b0100000;
-	if (instructionName == "or") return 0b0000000;
-	if (instructionName == "and") return 0b0000000;
-	cerr << "ERROR: Unknown opcode encountered '" << instructionName << "' at line " << line << "\n\n";
-	exit(0);
-	return -1;
-}
-
-uint32_t GetOpCode(const string& instructionName, int line) {
-	if (instructionName == "lui") return 0b0110111;
-	if (instructionName == "auipc") return 0b0010111;
-	if (instructionName == "jal") return 0b1101111;
-	if (instructionName == "jalr") return 0b1100111;
-	if (instructionName == "beq") return 0b1100011;
-	if (instructionName == "bne") return 0b1100011;
-	if (instructionName == "blt") return 0b1100011;
-	if (instructionName == "bge") return 0b1100011;
-	if (instructionName == "bltu") return 0b1100011;
-	if (instructionName == "bgeu") return 0b1100011;
-	if (instructionName == "lb") return 0b0000011;
-	if (instructionName == "lh") return 0b0000011;
-	if (instructionName == "lw") return 0b0000011;
-	if (instructionName == "lbu") return 0b0000011;
-	if (instructionName == "lhu") return 0b0000011;
-	if (instructionName == "sb") return 0b0100011;
-	if (instructionName == "sh") return 0b0100011;
-	if (instructionName == "sw") return 0b0100011;
-	if (instructionName == "addi") return 0b0010011;
-	if (instructionName == "slti") return 0b0010011;
-	if (instructionName == "sltiu") return 0b0010011;
-	if (instructionName == "xori") return 0b0010011;
-	if (instructionName == "ori") return 0b0010011;
-	if (instructionName == "andi") return 0b0010011;
-	if (instructionName == "slli") return 0b0010011;
-	if (instructionName == "srli") return 0b0010011;
-	if (instructionName == "srai") return 0b0010011;
-	if (instructionName == "add") return 0b0110011;
-	if (instructionName == "sub") return 0b0110011;
-	if (instructionName == "sll") return 0b0110011;
-	if (instructionName == "slt") return 0b0110011;
-	if (instructionName == "sltu") return 0b0110011;
-	if (instructionName == "xor") return 0b0110011;
-	if (instructionName == "srl") return 0b0110011;
-	if (instructionName == "sra") return 0b0110011;
-	if (instructionName == "or") return 0b0110011;
-	if (instructionName == "and") return 0b0110011;
-	cerr << "ERROR: Unknown opcode encountered '" << instructionName << "' at line " << line << "\n\n";
-	exit(0);
-	return -1;
-}
-
-string GetInstructionType(const string& instructionName, int line) {
-	if (instructionName == "lui") return "u";
-	if (instructionName == "auipc") return "u";
-	if (instructionName == "jal") return "j";
-	if (instructionName == "jalr") return "i";
-	if (instructionName == "beq") return "b";
-	if (instructionName == "bne") return "b";
-	if (instructionName == "blt") return "b";
-	if (instructionName == "bge") return "b";
-	if (instructionName == "bltu") return "b";
-	if (instructionName == "bgeu") return "b";
-	if (instructionName == "lb") return "i";
-	if (instructionName == "lh") return "i";
-	if (instructionName == "lw") return "i";
-	if (instructionName == "lbu") return "i";
-	if (instructionName == "lhu") return "i";
-	if (instructionName == "sb") return "s";
-	if (instructionName == "sh") return "s";
-	if (instructionName == "sw") return "s";
-	if (instructionName == "addi") return "i";
-	if (instructionName == "slti") return "i";
-	if (instructionName == "sltiu") return "i";
-	if (instructionName == "xori") return "i";
-	if (instructionName == "ori") return "i";
-	if (instructionName == "andi") return "i";
-	if (instructionName == "slli") return "i";
-	if (instructionName == "srli") return "i";
-	if (instructionName == "srai") return "i";
-	if (instructionName == "add") return "r";
-	if (instructionName == "sub") return "r";
-	if (instructionName == "sll") return "r";
-	if (instructionName == "slt") return "r";
-	if (instructionName == "sltu") return "r";
-	if (instructionName == "xor") return "r";
-	if (instructionName == "srl") return "r";
-	if (instructionName == "sra") return "r";
-	if (instructionName == "or") return "r";
-	if (instructionName == "and") return "r";
-	cerr << "ERROR: Unknown opcode encountered '" << instructionName << "' at line " << line << "\n\n";
-	exit(0);
-	return "";
 }
 
 uint32_t ParseImmediateValue(string token, int line, uint32_t* pOutRs1 = nullptr) {
@@ -318,10 +157,7 @@ uint32_t ParseImmediateValue(string token, int line, uint32_t* pOutRs1 = nullptr
 		cerr << "ERROR: Invalid syntax '" << token << "' at line: " << line << "\n\n";
 		exit(0);
 	}
-	if (open == 0) {
-		token = "0" + token;
-	}
-	string imm_text = token.substr(0, open);
+	string imm_text = open == 0 ? "0" : token.substr(0, open);
 	string rs1 = token.substr(open + 1, (close-open)-1);
 	uint32_t imm = 0;
 
@@ -340,9 +176,7 @@ uint32_t ParseImmediateValue(string token, int line, uint32_t* pOutRs1 = nullptr
 }
 
 uint32_t MakeRTypeInstruction(const vector<string>& tokens, int line, uint32_t* pRd, uint32_t* pRs1, uint32_t* pRs2) {
-	auto opcode = GetOpCode(tokens[0], line);
-	auto funct3 = GetInstructionFunct3(tokens[0], line);
-	auto funct7 = GetInstructionFunct7(tokens[0], line);
+	auto& row = GetInstruction(tokens[0], line);
 	auto rd = ParseRegister(tokens[1], line);
 	auto rs1 = ParseRegister(tokens[2], line);
 	auto rs2 = ParseRegister(tokens[3], line);
@@ -350,99 +184,133 @@ uint32_t MakeRTypeInstruction(const vector<string>& tokens, int line, uint32_t*
 		*pRd = rd;
 	if (pRs1) *pRs1 = rs1;
 	if (pRs2) *pRs2 = rs2;
-	// secret sause
-	return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | (opcode);
+	return isa::encode<isa::format::r>(row, rd, rs1, rs2, 0);
 }
 
+// Also the shifts, whose funct7 sits above the 5-bit shift amount.
 uint32_t MakeITypeInstruction(const vector<string>& tokens, int line, uint32_t* pRd, uint32_t* pRs1) {
-	auto opcode = GetOpCode(tokens[0], line);
-	auto funct3 = GetInstructionFunct3(tokens[0], line);
-	auto funct7 = GetInstructionFunct7(tokens[0], line);
+	auto& row = GetInstruction(tokens[0], line);
 	auto rd = ParseRegister(tokens[1], line);
 	auto rs1 = ParseRegister(tokens[2], line);
 	int32_t imm = ParseImmediateValue(tokens[3], line);
 	if (pRd) *pRd = rd;
 	if (pRs1) *pRs1 = rs1;
-	// secret sauce
-	return (imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | (opcode);
+	if (row.type == isa::format::shift)
+		return isa::encode<isa::format::shift>(row, rd, rs1, 0, imm);
+	return isa::encode<isa::format::i>(row, rd, rs1, 0, imm);
 }
 
 uint32_t MakeBTypeInstruction(const vector<string>& tokens, int line, uint32_t* pRs1, uint32_t* pRs2) {
-	auto opcode = GetOpCode(tokens[0], line);
-	auto funct3 = GetInstructionFunct3(tokens[0], line);
-	auto funct7 = GetInstructionFunct7(tokens[0], line);
+	auto& row = GetInstruction(tokens[0], line);
 	auto rs1 = ParseRegister(tokens[1], line);
 	auto rs2 = ParseRegister(tokens[2], line);
 	int32_t imm = ParseImmediateValue(tokens[3], line);
-	int32_t upper_imm = (imm & 0b111111100000) >> 5;
-	int32_t lower_imm = imm & 0b000000011111;
 	if (pRs1) *pRs1 = rs1;
 	if (pRs2) *pRs2 = rs2;
-	// secret sauce
-	return (upper_imm << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (lower_imm << 7) | (opcode);
+	return isa::encode<isa::format::b>(row, 0, rs1, rs2, imm);
 }
 
 uint32_t MakeSTypeInstruction(const vector<string>& tokens, int line, uint32_t* pRs1) {
-	auto opcode = GetOpCode(tokens[0], line);
-	auto funct3 = GetInstructionFunct3(tokens[0], line);
+	auto& row = GetInstruction(tokens[0], line);
 	auto rs2 = ParseRegister(tokens[1], line);
 	uint32_t rs1 = 0;
 	int32_t imm = ParseImmediateValue(tokens[2], line, &rs1);
-	int32_t upper_imm = (imm & 0b111111100000) >> 5;
-	int32_t lower_imm = imm & 0b000000011111;
 	if (pRs1) *pRs1 = rs1;
-
-	// secret sauce
-	return (upper_imm << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (lower_imm << 7) | (opcode);
+	return isa::encode<isa::format::s>(row, 0, rs1, rs2, imm);
 }
 
 uint32_t MakeITypeInstruction3(const vector<string>& tokens, int line, uint32_t* pRd, uint32_t* pRs1) {
-	auto opcode = GetOpCode(tokens[0], line);
-	auto funct3 = GetInstructionFunct3(tokens[0], line);
-	auto funct7 = GetInstructionFunct7(tokens[0], line);
+	auto& row = GetInstruction(tokens[0], line);
 	auto rd = ParseRegister(tokens[1], line);
 	uint32_t rs1;
 	int32_t imm = ParseImmediateValue(tokens[2], line, &rs1);
 	if (pRd) *pRd = rd;
 	if (pRs1) *pRs1 = rs1;
-	// secret sauce
-	return (imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | (opcode);
+	return isa::encode<isa::format::i>(row, rd, rs1, 0, imm);
 }
 
-uint32_t CompileInstruction(const vector<string>& tokens, int line, uint32_t* pOutReg, uint32_t* pOutRs1, uint32_t* pOutRs2) {
-	uint32_t THE_CODE = 0;
+// "lui x1, 0x12345", the upper 20 bits as the disassembler prints them, hex or decimal.
+uint32_t MakeUTypeInstruction(const vector<string>& tokens, int line, uint32_t* pRd) {
+	auto& row = GetInstruction(tokens[0], line);
+	auto rd = ParseRegister(tokens[1], line);
+	size_t end = 0;
+	unsigned long imm = 0;
+	try {
+		imm = stoul(tokens[2], &end, 0);
+	}
+	catch (...) {}
+	if (!end || end != tokens[2].size() || imm >= (1ul << 20)) {
+		cerr << "ERROR: Could not parse upper immediate '" << tokens[2] << "' at line: " << line << "\n\n";
+		exit(0);
+	}
+	if (pRd) *pRd = rd;
+	return isa::encode<isa::format::u>(row, rd, 0, 0, int32_t(imm << 12));
+}
 
-	auto AssertNTokens = [&](int n) {
-		if (tokens.size() < n) {
-			cerr << "\tERROR: Compiler does not support multi-line instructions. Check line " << line << endl;
-			exit(0);
-		}
-	};
+uint32_t MakeJTypeInstruction(const vector<string>& tokens, int line, uint32_t* pRd) {
+	auto& row = GetInstruction(tokens[0], line);
+	auto rd = ParseRegister(tokens[1], line);
+	int32_t imm = ParseImmediateValue(tokens[2], line);
+	if (pRd) *pRd = rd;
+	return isa::encode<isa::format::j>(row, rd, 0, 0, imm);
+}
 
-	if (tokens.size() == 4) {
-		auto type = GetInstructionType(tokens[0], line);
-		if (type == "r")
-			return MakeRTypeInstruction(tokens, line, pOutReg, pOutRs1, pOutRs2);
-		else if (type == "i")
-			return MakeITypeInstruction(tokens, line, pOutReg, pOutRs1);
-		else if (type == "b")
-			return MakeBTypeInstruction(tokens, line, pOutRs1, pOutRs2);
+// "lr.w rd, (rs1)" and "amoadd.w rd, rs2, (rs1)", sc.w included.
+uint32_t MakeAtomicInstruction(const vector<string>& tokens, int line, uint32_t* pRd, uint32_t* pRs1, uint32_t* pRs2) {
+	auto& row = GetInstruction(tokens[0], line);
+	auto rd = ParseRegister(tokens[1], line);
+	uint32_t rs1 = 0;
+	uint32_t rs2 = tokens.size() == 4 ? ParseRegister(tokens[2], line) : 0;
+	if (ParseImmediateValue(tokens.back(), line, &rs1) != 0 || tokens.back().find('(') == string::npos) {
+		cerr << "ERROR: Expected '(register)' without an offset, got '" << tokens.back() << "' at line: " << line << "\n\n";
+		exit(0);
 	}
-	else if (tokens.size() == 3) {
-		auto type = GetInstructionType(tokens[0], line);
-		if (type == "s")
-			return MakeSTypeInstruction(tokens, line, pOutRs1);
-		else if (type == "i")
-			return MakeITypeInstruction3(tokens, line, pOutReg, pOutRs1);
+	if (pRd) *pRd = rd;
+	if (pRs1) *pRs1 = rs1;
+	if (pRs2) *pRs2 = rs2;
+	return isa::encode<isa::format::amo>(row, rd, rs1, rs2, 0);
+}
+
+uint32_t CompileInstruction(const vector<string>& tokens, int line, uint32_t* pOutReg, uint32_t* pOutRs1, uint32_t* pOutRs2) {
+	auto& row = GetInstruction(tokens[0], line);
+	size_t operands = tokens.size() - 1;
+	switch (row.type) {
+	case isa::format::r:
+		if (operands == 3) return MakeRTypeInstruction(tokens, line, pOutReg, pOutRs1, pOutRs2);
+		break;
+	case isa::format::i:
+		if (operands == 3) return MakeITypeInstruction(tokens, line, pOutReg, pOutRs1);
+		if (operands == 2) return MakeITypeInstruction3(tokens, line, pOutReg, pOutRs1);
+		break;
+	case isa::format::shift:
+		if (operands == 3) return MakeITypeInstruction(tokens, line, pOutReg, pOutRs1);
+		break;
+	case isa::format::s:
+		if (operands == 2) return MakeSTypeInstruction(tokens, line, pOutRs1);
+		break;
+	case isa::format::b:
+		if (operands == 3) return MakeBTypeInstruction(tokens, line, pOutRs1, pOutRs2);
+		break;
+	case isa::format::u:
+		if (operands == 2) return MakeUTypeInstruction(tokens, line, pOutReg);
+		break;
+	case isa::format::j:
+		if (operands == 2) return MakeJTypeInstruction(tokens, line, pOutReg);
+		break;
+	case isa::format::amo:
+		if (operands == (row.id == isa::mnemonic::lr_w ? 2u : 3u)) return MakeAtomicInstruction(tokens, line, pOutReg, pOutRs1, pOutRs2);
+		break;
+	case isa::format::fence:
+		// fence orders everything, so there are no predecessor/successor sets to give
+		if (operands == 0) return isa::encode<isa::format::fence>(row, 0, 0, 0, 0);
+		break;
 	}
 
-	cerr << "\tERROR: Unsupported Condition unsupported, youssef fix this.\n";
+	cerr << "\tERROR: Wrong number of operands for '" << tokens[0] << "' at line " << line << endl;
 	exit(0);
-
-	return THE_CODE;
 }
 
-vector<uint32_t> CompileFile(ifstream& input) {
+vector<uint32_t> CompileFile(ifstream& input, map<string, uint32_t>* pLabels = nullptr) {
 	auto result = vector<uint32_t>{};
 
 	string line;
@@ -467,13 +335,20 @@ vector<uint32_t> CompileFile(ifstream& input) {
 			}
 			tokens.push_back(token);
 		}
+		if (tokens.empty()) {
+			lineNumber++;
+			continue;
+		}
 		// Is this a label?
 		if (tokens.size() == 1 && tokens[0].ends_with(":")) {
-			string label = tokens[0].substr(0, tokens[0].find(":") - 1);
+			string label = tokens[0].substr(0, tokens[0].find(":"));
 			if (labels.contains(label)) {
 				cerr << "\tERROR: Duplicate labels at line: " << line << endl;
 				exit(0);
 			}
+			labels[label] = uint32_t(result.size() * 4);
+			lineNumber++;
+			continue;
 		}
 		uint32_t writeReg{};
 		uint32_t rs1{};
@@ -494,14 +369,233 @@ vector<uint32_t> CompileFile(ifstream& input) {
 		lineNumber++;
 	}
 
+	if (pLabels) *pLabels = labels;
 	return result;
 }
 
+// RV32C compressed forms only reach registers x8-x15 in their 3-bit fields.
+bool IsCompressedRegister(uint32_t reg) {
+	return reg >= 8 && reg <= 15;
+}
+
+bool FitsSigned(int32_t value, int bits) {
+	return value >= -(1 << (bits - 1)) && value < (1 << (bits - 1));
+}
+
+// Returns the 16-bit RV32C encoding of an RV32I instruction, if one exists.
+// pc-relative jumps and branches are left alone by the caller so that the
+// program layout can be decided in a single pass.
+optional<uint16_t> CompressInstruction(uint32_t instruction) {
+	uint32_t opcode = instruction & 0x7f;
+	uint32_t rd = (instruction >> 7) & 0x1f;
+	uint32_t funct3 = (instruction >> 12) & 0x7;
+	uint32_t rs1 = (instruction >> 15) & 0x1f;
+	uint32_t rs2 = (instruction >> 20) & 0x1f;
+	uint32_t funct7 = instruction >> 25;
+	int32_t imm_i = int32_t(instruction) >> 20;
+	int32_t imm_s = ((int32_t(instruction) >> 25) << 5) | rd;
+	uint32_t shamt = rs2;
+
+	auto ci = [](uint32_t funct3, uint32_t imm5, uint32_t rd, uint32_t imm4_0, uint32_t op) {
+		return uint16_t((funct3 << 13) | ((imm5 & 1) << 12) | (rd << 7) | ((imm4_0 & 0x1f) << 2) | op);
+	};
+	auto cb_alu = [](uint32_t funct2, uint32_t rd, int32_t imm) {
+		return uint16_t((0b100 << 13) | (((imm >> 5) & 1) << 12) | (funct2 << 10) | ((rd - 8) << 7) | ((imm & 0x1f) << 2) | 0b01);
+	};
+	auto ca = [](uint32_t funct2, uint32_t rd, uint32_t rs2) {
+		return uint16_t((0b100011 << 10) | ((rd - 8) << 7) | (funct2 << 5) | ((rs2 - 8) << 2) | 0b01);
+	};
+	auto cr = [](uint32_t funct4, uint32_t rd, uint32_t rs2) {
+		return uint16_t((funct4 << 12) | (rd << 7) | (rs2 << 2) | 0b10);
+	};
+	auto cl_imm = [](uint32_t imm) {
+		return (((imm >> 3) & 0b111) << 10) | (((imm >> 2) & 1) << 6) | (((imm >> 6) & 1) << 5);
+	};
+
+	switch (opcode) {
+	case 0b0010011 /* i-type */:
+		switch (funct3) {
+		case 0b000 /* addi */:
+			if (rd && rd == rs1 && imm_i && FitsSigned(imm_i, 6))
+				return ci(0b000, imm_i >> 5, rd, imm_i, 0b01);												// c.addi
+			if (rd == 2 && rs1 == 2 && imm_i && !(imm_i & 0xf) && FitsSigned(imm_i, 10))
+				return uint16_t((0b011 << 13) | (((imm_i >> 9) & 1) << 12) | (2 << 7) | (((imm_i >> 4) & 1) << 6) |
+					(((imm_i >> 6) & 1) << 5) | (((imm_i >> 7) & 0b11) << 3) | (((imm_i >> 5) & 1) << 2) | 0b01);	// c.addi16sp
+			if (rs1 == 2 && IsCompressedRegister(rd) && imm_i > 0 && imm_i < 1024 && !(imm_i & 0b11))
+				return uint16_t((((imm_i >> 4) & 0b11) << 11) | (((imm_i >> 6) & 0xf) << 7) | (((imm_i >> 2) & 1) << 6) |
+					(((imm_i >> 3) & 1) << 5) | ((rd - 8) << 2) | 0b00);										// c.addi4spn
+			if (rd && !rs1 && FitsSigned(imm_i, 6))
+				return ci(0b010, imm_i >> 5, rd, imm_i, 0b01);												// c.li
+			if (rd && rs1 && !imm_i)
+				return cr(0b1000, rd, rs1);																	// c.mv
+			break;
+		case 0b001 /* slli */:
+			if (rd && rd == rs1 && shamt && !funct7)
+				return ci(0b000, 0, rd, shamt, 0b10);
+			break;
+		case 0b101 /* srli and srai */:
+			if (IsCompressedRegister(rd) && rd == rs1 && shamt && (funct7 == 0 || funct7 == 0b0100000))
+				return cb_alu(funct7 ? 0b01 : 0b00, rd, shamt);
+			break;
+		case 0b111 /* andi */:
+			if (IsCompressedRegister(rd) && rd == rs1 && FitsSigned(imm_i, 6))
+				return cb_alu(0b10, rd, imm_i);
+			break;
+		}
+		break;
+	case 0b0110111 /* lui */: {
+		int32_t imm = int32_t(instruction) >> 12;
+		if (rd && rd != 2 && imm && FitsSigned(imm, 6))
+			return ci(0b011, imm >> 5, rd, imm, 0b01);
+		break;
+	}
+	case 0b0110011 /* r-type */:
+		if (funct3 == 0b000 && !funct7) {
+			if (rd && !rs1 && rs2)
+				return cr(0b1000, rd, rs2);			// c.mv
+			if (rd && rd == rs1 && rs2)
+				return cr(0b1001, rd, rs2);			// c.add
+			if (rd && rd == rs2 && rs1)
+				return cr(0b1001, rd, rs1);			// c.add, operands swapped
+			break;
+		}
+		if (!IsCompressedRegister(rd) || !IsCompressedRegister(rs1) || !IsCompressedRegister(rs2))
+			break;
+		if (funct3 == 0b000 && funct7 == 0b0100000 && rd == rs1)
+			return ca(0b00, rd, rs2);				// c.sub
+		if (funct7)
+			break;
+		if (funct3 == 0b100 || funct3 == 0b110 || funct3 == 0b111) {
+			uint32_t funct2 = funct3 == 0b100 ? 0b01 : funct3 == 0b110 ? 0b10 : 0b11;
+			if (rd == rs1)
+				return ca(funct2, rd, rs2);			// c.xor, c.or, c.and
+			if (rd == rs2)
+				return ca(funct2, rd, rs1);
+		}
+		break;
+	case 0b0000011 /* loads */:
+		if (funct3 != 0b010 /* lw */ || imm_i < 0 || (imm_i & 0b11))
+			break;
+		if (rs1 == 2 && rd && imm_i < 256)
+			return uint16_t((0b010 << 13) | (((imm_i >> 5) & 1) << 12) | (rd << 7) | (((imm_i >> 2) & 0b111) << 4) | (((imm_i >> 6) & 0b11) << 2) | 0b10);
+		if (IsCompressedRegister(rd) && IsCompressedRegister(rs1) && imm_i < 128)
+			return uint16_t((0b010 << 13) | cl_imm(imm_i) | ((rs1 - 8) << 7) | ((rd - 8) << 2) | 0b00);
+		break;
+	case 0b0100011 /* stores */:
+		if (funct3 != 0b010 /* sw */ || imm_s < 0 || (imm_s & 0b11))
+			break;
+		if (rs1 == 2 && imm_s < 256)
+			return uint16_t((0b110 << 13) | (((imm_s >> 2) & 0xf) << 9) | (((imm_s >> 6) & 0b11) << 7) | (rs2 << 2) | 0b10);
+		if (IsCompressedRegister(rs2) && IsCompressedRegister(rs1) && imm_s < 128)
+			return uint16_t((0b110 << 13) | cl_imm(imm_s) | ((rs1 - 8) << 7) | ((rs2 - 8) << 2) | 0b00);
+		break;
+	case 0b1100111 /* jalr */:
+		if (funct3 == 0b000 && rs1 && !imm_i && (rd == 0 || rd == 1))
+			return cr(rd ? 0b1001 : 0b1000, rs1, 0);	// c.jalr / c.jr
+		break;
+	}
+	return nullopt;
+}
+
+struct CompressionStats {
+	uint32_t Instructions = 0;
+	uint32_t Compressed = 0;
+	uint32_t OriginalBytes = 0;
+	uint32_t CompressedBytes = 0;
+};
+
+// Re-lays out an RV32I program using RV32C encodings wherever possible.
+// Branch and jal offsets written against the uncompressed layout are relocated
+// to the new addresses, the instructions themselves stay 32-bit.
+vector<uint32_t> CompressProgram(const vector<uint32_t>& code, CompressionStats& stats, vector<uint32_t>* pNewAddress = nullptr) {
+	vector<optional<uint16_t>> compressed(code.size());
+	vector<uint32_t> newAddress(code.size() + 1);
+
+	uint32_t address = 0;
+	for (size_t i = 0; i < code.size(); i++) {
+		uint32_t opcode = code[i] & 0x7f;
+		bool pcRelative = opcode == 0b1100011 || opcode == 0b1101111;
+		newAddress[i] = address;
+		if (!pcRelative)
+			compressed[i] = CompressInstruction(code[i]);
+		address += compressed[i] ? 2 : 4;
+		stats.Instructions += code[i] != 0;
+		stats.Compressed += compressed[i].has_value();
+	}
+	newAddress[code.size()] = address;
+
+	vector<uint16_t> parcels;
+	for (size_t i = 0; i < code.size(); i++) {
+		if (compressed[i]) {
+			parcels.push_back(*compressed[i]);
+			continue;
+		}
+		uint32_t instruction = code[i];
+		uint32_t opcode = instruction & 0x7f;
+		if (opcode == 0b1100011 || opcode == 0b1101111) {
+			bool isBranch = opcode == 0b1100011;
+			int64_t target = int64_t(i * 4) + (isBranch ? isa::immediate<isa::format::b>(instruction) : isa::immediate<isa::format::j>(instruction));
+			if (target < 0 || target % 4 || size_t(target / 4) > code.size()) {
+				cerr << "\tERROR: Cannot relocate branch at instruction " << i << ", target is outside the program\n";
+				exit(0);
+			}
+			int32_t offset = int32_t(newAddress[target / 4]) - int32_t(newAddress[i]);
+			instruction = isBranch ? isa::with_immediate<isa::format::b>(instruction, offset) : isa::with_immediate<isa::format::j>(instruction, offset);
+		}
+		parcels.push_back(uint16_t(instruction));
+		parcels.push_back(uint16_t(instruction >> 16));
+	}
+	if (parcels.size() & 1)
+		parcels.push_back(0x0001); // c.nop
+
+	vector<uint32_t> result;
+	for (size_t i = 0; i < parcels.size(); i += 2)
+		result.push_back(parcels[i] | (uint32_t(parcels[i + 1]) << 16));
+
+	stats.OriginalBytes = uint32_t(code.size() * 4);
+	stats.CompressedBytes = uint32_t(parcels.size() * 2);
+	if (pNewAddress) *pNewAddress = newAddress;
+	return result;
+}
+
+void WriteProgram(const string& path, const vector<uint32_t>& code) {
+	ofstream output(path);
+	if (!output) {
+		cerr << "\tERROR: Failed to open output file '" << path << "'";
+		exit(0);
+	}
+	char line[16];
+	for (auto word : code) {
+		snprintf(line, sizeof(line), "%08x\n", word);
+		output << line;
+	}
+}
+
+// The label map the disassembler and emulator read symbol names from.
+void WriteLabelMap(const string& path, const map<string, uint32_t>& labels) {
+	ofstream output(path);
+	if (!output) {
+		cerr << "\tERROR: Failed to open label map '" << path << "'";
+		exit(0);
+	}
+	vector<pair<uint32_t, string>> byAddress;
+	for (auto& [name, address] : labels)
+		byAddress.push_back({ address, name });
+	sort(byAddress.begin(), byAddress.end());
+	char line[16];
+	for (auto& [address, name] : byAddress) {
+		snprintf(line, sizeof(line), "%08x ", address);
+		output << line << name << '\n';
+	}
+}
+
 int main(int argc, char** argv) {
 
 	auto cargs = ProccessArguments(argc, argv, {
 		make_pair("-i", ArgOpt{true}),
 		make_pair("-o", ArgOpt{string("a.bin")}),
+		make_pair("-march", ArgOpt{string("rv32i")}),
+		make_pair("-map", ArgOpt{}),	// also write the label addresses, for the disassembler
 	});
 
 	auto file = cargs.ArgToValue["-i"];
@@ -511,7 +605,27 @@ int main(int argc, char** argv) {
 	cout << "Compiling " << file << "...\n";
 
 	auto ifs = OpenFileStream(file);
-	auto code = CompileFile(ifs);
+	map<string, uint32_t> labels;
+	auto code = CompileFile(ifs, &labels);
+
+	if (cargs.ArgToValue["-march"] == "rv32ic") {
+		CompressionStats stats;
+		vector<uint32_t> newAddress;
+		code = CompressProgram(code, stats, &newAddress);
+		for (auto& [name, address] : labels)
+			address = newAddress[address / 4];
+		cout << "Code size: " << stats.OriginalBytes << " bytes (RV32I) -> " << stats.CompressedBytes << " bytes (RV32IC), "
+			<< stats.Compressed << "/" << stats.Instructions << " instructions compressed, "
+			<< (stats.OriginalBytes ? 100 * (stats.OriginalBytes - stats.CompressedBytes) / stats.OriginalBytes : 0) << "% smaller\n";
+	}
+	else if (cargs.ArgToValue["-march"] != "rv32i") {
+		cerr << "\tERROR: Unsupported -march '" << cargs.ArgToValue["-march"] << "', expected rv32i or rv32ic\n";
+		exit(0);
+	}
+
+	WriteProgram(cargs.ArgToValue["-o"], code);
+	if (!cargs.ArgToValue["-map"].empty())
+		WriteLabelMap(cargs.ArgToValue["-map"], labels);
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,218 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <map>
+#include <cstdio>
+#include <cctype>
+#include "../risc-emulator/disassembler.h"
+#include "../risc-emulator/arguments.h"
+
+// What the input is, each gets the disassembly next to its instruction word:
+//   log    emulator.log, "0001 (06123B93):   regs", pc unknown
+//   csv    log-checker's emulator-csv/core-csv, an "asm" column after "instr"
+//   trace  the fuzzer's .trace files, "pc instruction ..."
+//   image  a program image, one hex word per line, listed by address
+enum class input_format { log, csv, trace, image };
+
+bool is_hex(const std::string& text, size_t at, size_t digits) {
+	if (text.size() < at + digits) return false;
+	for (size_t i = at; i < at + digits; i++)
+		if (!isxdigit((unsigned char)text[i])) return false;
+	return true;
+}
+
+input_format detect(const std::string& line) {
+	if (line.rfind("instr,", 0) == 0) return input_format::csv;
+	if (line.rfind("# seed", 0) == 0) return input_format::trace;
+	size_t open = line.find(" (");
+	if (open != std::string::npos && is_hex(line, open + 2, 8) && line.compare(open + 10, 2, "):") == 0) return input_format::log;
+	if (is_hex(line, 0, 8) && line.size() > 9 && line[8] == ' ' && is_hex(line, 9, 8)) return input_format::trace;
+	return input_format::image;
+}
+
+input_format parse_format(const std::string& name) {
+	if (name == "log") return input_format::log;
+	if (name == "csv") return input_format::csv;
+	if (name == "trace") return input_format::trace;
+	if (name == "image") return input_format::image;
+	fprintf(stderr, "ERROR: Unknown -format '%s' (auto, log, csv, trace, image are valid)\n", name.c_str());
+	exit(1);
+}
+
+// Streams the input through once, appending into one output buffer that is
+// written out in large blocks.
+class annotator {
+public:
+	annotator(const disassembler& dis, FILE* out, size_t width) : dis(dis), out(out), width(width) { buffer.reserve(1 << 20); }
+	~annotator() { flush(); }
+
+	void line(const std::string& text, input_format format) {
+		switch (format) {
+		case input_format::log: log_line(text); break;
+		case input_format::csv: csv_line(text); break;
+		case input_format::trace: trace_line(text); break;
+		case input_format::image: image_line(text); break;
+		}
+		if (buffer.size() >= (1 << 20) - 4096) flush();
+	}
+
+	// Images are listed by fetch address, RV32C parcels included.
+	void finish_image() {
+		if (image.empty()) return;
+		cpu_risc32i cpu(uint32_t(image.size()));
+		cpu.load_program(0, image);
+		uint32_t end = uint32_t(image.size() * 4);
+		for (uint32_t pc = 0; pc < end;) {
+			uint32_t word = cpu.fetch_instruction(pc);
+			// A zero parcel is the assembler's hazard nop under rv32ic, a zero word one under rv32i
+			bool half = (word & 0b11) != 0b11 && ((pc & 2) || cpu.program_memory()[pc >> 2]);
+			char prefix[32];
+			int n = half ? snprintf(prefix, sizeof(prefix), "%08x:     %04x  ", pc, word) : snprintf(prefix, sizeof(prefix), "%08x: %08x  ", pc, word);
+			buffer.append(prefix, n);
+			append_disassembly(word, pc, 0);
+			buffer.push_back('\n');
+			pc += half ? 2 : 4;
+			if (buffer.size() >= (1 << 20) - 4096) flush();
+		}
+		image.clear();
+	}
+
+	void flush() {
+		fwrite(buffer.data(), 1, buffer.size(), out);
+		buffer.clear();
+	}
+
+private:
+	void append_disassembly(uint32_t word, uint32_t pc, size_t pad) {
+		char text[256];
+		size_t n = dis.format(word, pc, text, sizeof(text));
+		buffer.append(text, n);
+		if (n < pad) buffer.append(pad - n, ' ');
+	}
+
+	// "0001 (06123B93):   ..." -> "0001 (06123B93) sltiu x23, x4, 97   :   ..."
+	void log_line(const std::string& text) {
+		size_t open = text.find('('), close = text.find(')');
+		size_t colon = text.find(':');
+		if (open == std::string::npos || close != open + 9 || colon == std::string::npos || !is_hex(text, open + 1, 8)) {
+			buffer += text;
+			buffer.push_back('\n');
+			return;
+		}
+		buffer.append(text, 0, close + 1);
+		buffer.push_back(' ');
+		append_disassembly(uint32_t(std::stoul(text.substr(open + 1, 8), nullptr, 16)), disassembler::no_pc, width);
+		buffer.append(text, colon, std::string::npos);
+		buffer.push_back('\n');
+	}
+
+	void csv_line(const std::string& text) {
+		size_t comma = text.find(',');
+		if (comma == std::string::npos) {
+			buffer += text;
+			buffer.push_back('\n');
+			return;
+		}
+		buffer.append(text, 0, comma + 1);
+		if (text.rfind("instr,", 0) == 0)
+			buffer += "asm,";
+		else if (is_hex(text, 0, comma) && comma) {
+			buffer.push_back('"');
+			append_disassembly(uint32_t(std::stoul(text.substr(0, comma), nullptr, 16)), disassembler::no_pc, 0);
+			buffer += "\",";
+		}
+		else
+			buffer.push_back(',');
+		buffer.append(text, comma + 1, std::string::npos);
+		buffer.push_back('\n');
+	}
+
+	// "00000008 d0835183 x3=00000000" -> "00000008 d0835183 lh x3, -760(x6)   x3=00000000"
+	void trace_line(const std::string& text) {
+		if (!is_hex(text, 0, 8) || text.size() < 17 || text[8] != ' ' || !is_hex(text, 9, 8)) {
+			buffer += text;
+			buffer.push_back('\n');
+			return;
+		}
+		buffer.append(text, 0, 17);
+		buffer.push_back(' ');
+		bool more = text.size() > 17;
+		append_disassembly(uint32_t(std::stoul(text.substr(9, 8), nullptr, 16)), uint32_t(std::stoul(text.substr(0, 8), nullptr, 16)), more ? width : 0);
+		if (more) buffer.append(text, 17, std::string::npos);
+		buffer.push_back('\n');
+	}
+
+	void image_line(const std::string& text) {
+		size_t start = text.find_first_not_of(" \t");
+		if (start == std::string::npos || text[start] == '#') return;
+		image.push_back(uint32_t(std::stoul(text.substr(start), nullptr, 16)));
+	}
+
+	const disassembler& dis;
+	FILE* out;
+	size_t width;
+	std::string buffer;
+	std::vector<uint32_t> image;
+};
+
+int main(int argc, char** argv) {
+
+	auto args = ProccessArguments(argc, argv, {
+		std::make_pair("-i", ArgOpt{true}),							// emulator.log, a log-checker csv, a fuzzer trace or a program image
+		std::make_pair("-o", ArgOpt{}),								// output file, stdout when not given
+		std::make_pair("-format", ArgOpt{std::string("auto")}),	// auto, log, csv, trace, image
+		std::make_pair("-map", ArgOpt{}),							// label map from the assembler's -map
+		std::make_pair("-abi", ArgOpt{std::string("0")}),			// 1 = ABI register names instead of x0-x31
+		std::make_pair("-width", ArgOpt{std::string("32")}),		// column the disassembly is padded to
+	});
+
+	std::ifstream input(args["-i"]);
+	if (!input) {
+		fprintf(stderr, "ERROR: Cannot open '%s'\n", args["-i"].c_str());
+		return 1;
+	}
+	FILE* out = stdout;
+	if (!args["-o"].empty() && !(out = fopen(args["-o"].c_str(), "wb"))) {
+		fprintf(stderr, "ERROR: Cannot write '%s'\n", args["-o"].c_str());
+		return 1;
+	}
+
+	symbol_map symbols;
+	disassembler dis;
+	dis.abi_names = args["-abi"] != "0";
+	if (!args["-map"].empty()) {
+		try {
+			symbols.load(args["-map"]);
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "ERROR: %s\n", e.what());
+			return 1;
+		}
+		dis.symbols = &symbols;
+	}
+
+	bool automatic = args["-format"] == "auto";
+	input_format format = automatic ? input_format::image : parse_format(args["-format"]);
+	{
+		annotator annotate(dis, out, std::stoul(args["-width"]));
+		bool first = true;
+		for (std::string line; std::getline(input, line);) {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			if (automatic && first && !line.empty()) {
+				format = detect(line);
+				first = false;
+			}
+			try {
+				annotate.line(line, format);
+			}
+			catch (const std::exception&) {
+				fprintf(stderr, "ERROR: Cannot parse '%s'\n", line.c_str());
+				return 1;
+			}
+		}
+		annotate.finish_image();
+	}
+	if (out != stdout) fclose(out);
+	return 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+
+// "-name value" command lines, shared by the emulator, the benchmark, the
+// fuzzer and the disassembler. A bad command line ends the process with exit
+// code 1, so scripts see it fail.
+struct ArgOpt {
+	bool MustBeSupplied = false;
+	std::string DefaultValue;
+
+	ArgOpt() = default;
+	ArgOpt(bool mustBeSupplied) : MustBeSupplied(mustBeSupplied) {}
+	ArgOpt(const std::string& defaultValue) : DefaultValue(defaultValue) {}
+};
+
+inline std::map<std::string, std::string> ProccessArguments(int argc, char** argv, const std::map<std::string, ArgOpt>& programArgumentList) {
+	std::map<std::string, std::string> result;
+	for (auto& [argName, opt] : programArgumentList)
+		if (!opt.DefaultValue.empty())
+			result[argName] = opt.DefaultValue;
+
+	for (int i = 1; i < argc; i++) {
+		if (!programArgumentList.contains(argv[i])) {
+			fprintf(stderr, "ERROR: Unknown argument '%s'\n", argv[i]);
+			exit(1);
+		}
+		if (i + 1 >= argc) {
+			fprintf(stderr, "ERROR: Missing value for argument '%s'\n", argv[i]);
+			exit(1);
+		}
+		result[argv[i]] = argv[i + 1];
+		i++;
+	}
+	for (auto& [argName, opt] : programArgumentList) {
+		if (opt.MustBeSupplied && !result.contains(argName)) {
+			fprintf(stderr, "ERROR: Missing required argument '%s'\n", argName.c_str());
+			exit(1);
+		}
+	}
+	return result;
+}
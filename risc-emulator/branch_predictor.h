@@ -0,0 +1,185 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+// Direction predictor for conditional (B-type) branches.
+class branch_predictor {
+public:
+	virtual ~branch_predictor() = default;
+	virtual const char* name() const = 0;
+	virtual bool predict(uint32_t pc, uint32_t target) = 0;
+	virtual void update(uint32_t pc, bool taken) = 0;
+};
+
+// Backward taken, forward not taken.
+class static_predictor : public branch_predictor {
+public:
+	const char* name() const override { return "static (BTFN)"; }
+	bool predict(uint32_t pc, uint32_t target) override { return target < pc; }
+	void update(uint32_t, bool) override {}
+};
+
+// Table of 2-bit saturating counters indexed by pc.
+class bimodal_predictor : public branch_predictor {
+public:
+	bimodal_predictor(uint32_t index_bits) : counters(size_t(1) << index_bits, 1), mask((1u << index_bits) - 1) {}
+
+	const char* name() const override { return "bimodal"; }
+	bool predict(uint32_t pc, uint32_t) override { return counters[index(pc)] >= 2; }
+	void update(uint32_t pc, bool taken) override {
+		uint8_t& counter = counters[index(pc)];
+		if (taken) counter += counter < 3;
+		else counter -= counter > 0;
+	}
+
+private:
+	uint32_t index(uint32_t pc) const { return (pc >> 1) & mask; }
+
+	std::vector<uint8_t> counters;
+	uint32_t mask;
+};
+
+// 2-bit counters indexed by pc xor global branch history.
+class gshare_predictor : public branch_predictor {
+public:
+	gshare_predictor(uint32_t index_bits) : counters(size_t(1) << index_bits, 1), mask((1u << index_bits) - 1) {}
+
+	const char* name() const override { return "gshare"; }
+	bool predict(uint32_t pc, uint32_t) override { return counters[index(pc)] >= 2; }
+	void update(uint32_t pc, bool taken) override {
+		uint8_t& counter = counters[index(pc)];
+		if (taken) counter += counter < 3;
+		else counter -= counter > 0;
+		history = ((history << 1) | uint32_t(taken)) & mask;
+	}
+
+private:
+	uint32_t index(uint32_t pc) const { return ((pc >> 1) ^ history) & mask; }
+
+	std::vector<uint8_t> counters;
+	uint32_t mask;
+	uint32_t history = 0;
+};
+
+// Observes every control transfer retired by the cpu, runs it through a direction
+// predictor and a return-address stack, and keeps per-pc accuracy counters.
+class branch_model {
+public:
+	struct site_stats {
+		uint64_t executed = 0;
+		uint64_t mispredicted = 0;
+		uint8_t kind = 0;
+	};
+
+	enum site_kind : uint8_t { conditional = 1, call = 2, ret = 3, indirect = 4 };
+
+	branch_model(std::unique_ptr<branch_predictor> predictor, uint32_t ras_depth = 16, uint32_t penalty = 2)
+		: predictor(std::move(predictor)), ras(std::max<uint32_t>(ras_depth, 1)), penalty(penalty) {}
+
+	// Counter tables are 2^index_bits entries, 16M at most.
+	static constexpr uint32_t max_index_bits = 24;
+
+	static std::unique_ptr<branch_model> create(const std::string& type, uint32_t index_bits, uint32_t ras_depth, uint32_t penalty) {
+		if (type != "static" && (index_bits < 1 || index_bits > max_index_bits))
+			throw std::runtime_error("-bp-bits " + std::to_string(index_bits) + " is out of range (1 to " + std::to_string(max_index_bits) + ")");
+		std::unique_ptr<branch_predictor> predictor;
+		if (type == "static") predictor = std::make_unique<static_predictor>();
+		else if (type == "bimodal") predictor = std::make_unique<bimodal_predictor>(index_bits);
+		else if (type == "gshare") predictor = std::make_unique<gshare_predictor>(index_bits);
+		else throw std::runtime_error("Unknown branch predictor '" + type + "' (static, bimodal, gshare are valid)");
+		return std::make_unique<branch_model>(std::move(predictor), ras_depth, penalty);
+	}
+
+	void branch(uint32_t pc, uint32_t target, bool taken) {
+		bool miss = predictor->predict(pc, target) != taken;
+		predictor->update(pc, taken);
+		record(pc, conditional, miss);
+	}
+
+	// jal/jalr, using the RISC-V link register hints: rd of x1/x5 pushes the
+	// return address, a jalr through x1/x5 that does not link pops it.
+	void jump(uint32_t pc, uint32_t target, uint32_t rd, uint32_t rs1, uint32_t ilen, bool indirect_jump) {
+		bool links = rd == 1 || rd == 5;
+		bool returns = indirect_jump && (rs1 == 1 || rs1 == 5) && rs1 != rd;
+
+		if (returns) {
+			bool miss = !ras_size || ras[(ras_top + ras.size() - 1) % ras.size()] != target;
+			if (ras_size) {
+				ras_top = (ras_top + ras.size() - 1) % ras.size();
+				ras_size--;
+			}
+			record(pc, ret, miss);
+		}
+		else if (indirect_jump) {
+			// no indirect target predictor, every non-return jalr redirects fetch
+			record(pc, indirect, true);
+		}
+		else if (links) {
+			record(pc, call, false);
+		}
+
+		if (links) {
+			ras[ras_top] = pc + ilen;
+			ras_top = (ras_top + 1) % ras.size();
+			ras_size = std::min<uint32_t>(ras_size + 1, uint32_t(ras.size()));
+		}
+	}
+
+	void report(FILE* out, uint64_t instructions, size_t top_sites = 10) const {
+		uint64_t executed = 0, mispredicted = 0, conditionals = 0, conditional_misses = 0;
+		for (auto& site : sites) {
+			executed += site.executed;
+			mispredicted += site.mispredicted;
+			if (site.kind == conditional) {
+				conditionals += site.executed;
+				conditional_misses += site.mispredicted;
+			}
+		}
+
+		fprintf(out, "\nBranch predictor: %s, %u entry RAS, %u cycle mispredict penalty\n", predictor->name(), uint32_t(ras.size()), penalty);
+		fprintf(out, "  control transfers  %llu, mispredicted %llu (%.2f%% accuracy)\n", (unsigned long long)executed,
+			(unsigned long long)mispredicted, executed ? 100.0 * (executed - mispredicted) / executed : 100.0);
+		fprintf(out, "  conditional        %llu, mispredicted %llu (%.2f%% accuracy)\n", (unsigned long long)conditionals,
+			(unsigned long long)conditional_misses, conditionals ? 100.0 * (conditionals - conditional_misses) / conditionals : 100.0);
+		fprintf(out, "  penalty cycles     %llu", (unsigned long long)(mispredicted * penalty));
+		if (instructions)
+			fprintf(out, " (%.2f MPKI, est. CPI %.3f)", 1000.0 * mispredicted / instructions, double(instructions + mispredicted * penalty) / instructions);
+		fprintf(out, "\n");
+
+		std::vector<uint32_t> pcs;
+		for (uint32_t i = 0; i < sites.size(); i++)
+			if (sites[i].executed) pcs.push_back(i << 1);
+		std::sort(pcs.begin(), pcs.end(), [this](uint32_t a, uint32_t b) { return sites[a >> 1].mispredicted > sites[b >> 1].mispredicted; });
+
+		static const char* kind_names[] = { "", "branch", "call", "return", "indirect" };
+		fprintf(out, "  %-10s  %-8s  %12s  %12s  %8s\n", "pc", "kind", "executed", "mispredicted", "accuracy");
+		for (size_t i = 0; i < std::min(top_sites, pcs.size()); i++) {
+			auto& site = sites[pcs[i] >> 1];
+			fprintf(out, "  0x%08X  %-8s  %12llu  %12llu  %7.2f%%\n", pcs[i], kind_names[site.kind], (unsigned long long)site.executed,
+				(unsigned long long)site.mispredicted, 100.0 * (site.executed - site.mispredicted) / site.executed);
+		}
+	}
+
+private:
+	void record(uint32_t pc, site_kind kind, bool miss) {
+		uint32_t slot = pc >> 1;
+		if (slot >= sites.size())
+			sites.resize(std::max<size_t>(slot + 1, sites.size() * 2));
+		auto& site = sites[slot];
+		site.executed++;
+		site.mispredicted += miss;
+		site.kind = kind;
+	}
+
+	std::unique_ptr<branch_predictor> predictor;
+	std::vector<uint32_t> ras;
+	uint32_t ras_top = 0;
+	uint32_t ras_size = 0;
+	uint32_t penalty;
+	std::vector<site_stats> sites; // indexed by pc >> 1
+};
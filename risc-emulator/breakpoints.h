@@ -0,0 +1,273 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+// One bit per halfword of address space up to the highest breakpoint, so the
+// check made after every instruction is a shift, a bounds test and a load.
+class pc_bitmap {
+public:
+	void insert(uint32_t pc) {
+		uint32_t slot = pc >> 1;
+		if ((slot >> 6) >= bits.size())
+			bits.resize((slot >> 6) + 1, 0);
+		if (!test(pc)) count++;
+		bits[slot >> 6] |= uint64_t(1) << (slot & 63);
+	}
+
+	void erase(uint32_t pc) {
+		if (!test(pc)) return;
+		uint32_t slot = pc >> 1;
+		bits[slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+		count--;
+	}
+
+	bool test(uint32_t pc) const {
+		uint32_t slot = pc >> 1;
+		return (slot >> 6) < bits.size() && (bits[slot >> 6] >> (slot & 63)) & 1;
+	}
+
+	bool empty() const { return !count; }
+	void clear() { bits.clear(); count = 0; }
+
+private:
+	std::vector<uint64_t> bits;
+	uint32_t count = 0;
+};
+
+// Write watchpoints on data memory (word indexed, like loads and stores). Each
+// 4KB page carries a count of watchpoints touching it, so a store into an
+// unwatched page costs one table lookup and the ranges are only searched on
+// watched pages.
+class watchpoint_set {
+public:
+	static constexpr uint32_t page_shift = 10;
+
+	struct watch {
+		uint32_t first;	// word index
+		uint32_t last;	// inclusive
+	};
+
+	void insert(uint32_t first, uint32_t words = 1) {
+		watch w{ first, first + (words ? words : 1) - 1 };
+		if ((w.last >> page_shift) >= pages.size())
+			pages.resize((w.last >> page_shift) + 1, 0);
+		for (uint32_t page = w.first >> page_shift; page <= w.last >> page_shift; page++)
+			pages[page]++;
+		watches.push_back(w);
+	}
+
+	bool erase(uint32_t first, uint32_t words = 1) {
+		uint32_t last = first + (words ? words : 1) - 1;
+		for (size_t i = 0; i < watches.size(); i++) {
+			if (watches[i].first != first || watches[i].last != last) continue;
+			for (uint32_t page = first >> page_shift; page <= last >> page_shift; page++)
+				pages[page]--;
+			watches.erase(watches.begin() + i);
+			return true;
+		}
+		return false;
+	}
+
+	bool watches_page(uint32_t address) const {
+		uint32_t page = address >> page_shift;
+		return page < pages.size() && pages[page];
+	}
+
+	// Called after a store into a watched page, returns true if a watch covers it.
+	bool check(uint32_t address, uint32_t pc) {
+		for (auto& w : watches) {
+			if (address < w.first || address > w.last) continue;
+			hit_address = address;
+			hit_pc = pc;
+			return true;
+		}
+		return false;
+	}
+
+	bool empty() const { return watches.empty(); }
+
+	uint32_t hit_address = 0;
+	uint32_t hit_pc = 0;
+
+private:
+	std::vector<watch> watches;
+	std::vector<uint16_t> pages;
+};
+
+// Boolean expression over registers, pc and data memory, e.g.
+//   a0 == 5 && mem[0x40] != 0
+//   x5 >= 0x100 || (sp < 512 && ra == pc)
+// Compiled once into a small stack program. Comparisons are unsigned.
+class condition {
+public:
+	condition() = default;
+
+	// Throws std::runtime_error on a syntax error.
+	explicit condition(const std::string& expression) : text(expression), cursor(text.c_str()) {
+		parse_or();
+		skip_spaces();
+		if (*cursor)
+			throw std::runtime_error("Unexpected '" + std::string(cursor) + "' in condition");
+		cursor = nullptr;
+	}
+
+	bool evaluate(const int32_t* registers, uint32_t pc, const std::vector<uint32_t>& memory) const {
+		uint32_t stack[32];
+		int top = -1;
+		for (auto& op : program) {
+			switch (op.kind) {
+			case push_constant: stack[++top] = op.value; break;
+			case push_register: stack[++top] = uint32_t(registers[op.value]); break;
+			case push_pc: stack[++top] = pc; break;
+			case load_memory: stack[top] = memory[stack[top] % memory.size()]; break;
+			default: {
+				uint32_t rhs = stack[top--], lhs = stack[top];
+				switch (op.kind) {
+				case equal: stack[top] = lhs == rhs; break;
+				case not_equal: stack[top] = lhs != rhs; break;
+				case less: stack[top] = lhs < rhs; break;
+				case less_equal: stack[top] = lhs <= rhs; break;
+				case greater: stack[top] = lhs > rhs; break;
+				case greater_equal: stack[top] = lhs >= rhs; break;
+				case logical_and: stack[top] = lhs && rhs; break;
+				case logical_or: stack[top] = lhs || rhs; break;
+				default: break;
+				}
+			}
+			}
+		}
+		return top >= 0 && stack[top];
+	}
+
+	bool empty() const { return program.empty(); }
+	const std::string& source() const { return text; }
+
+private:
+	enum op_kind : uint8_t {
+		push_constant, push_register, push_pc, load_memory,
+		equal, not_equal, less, less_equal, greater, greater_equal, logical_and, logical_or
+	};
+	struct op {
+		op_kind kind;
+		uint32_t value;
+	};
+
+	void skip_spaces() { while (*cursor == ' ' || *cursor == '\t') cursor++; }
+
+	bool accept(const char* token) {
+		skip_spaces();
+		size_t length = strlen(token);
+		if (strncmp(cursor, token, length)) return false;
+		cursor += length;
+		return true;
+	}
+
+	void emit(op_kind kind, uint32_t value = 0) {
+		program.push_back({ kind, value });
+		depth += kind <= push_pc ? 1 : kind == load_memory ? 0 : -1;
+		max_depth = std::max(max_depth, depth);
+		if (max_depth > 32)
+			throw std::runtime_error("Condition is nested too deeply");
+	}
+
+	void parse_or() {
+		parse_and();
+		while (accept("||")) { parse_and(); emit(logical_or); }
+	}
+
+	void parse_and() {
+		parse_comparison();
+		while (accept("&&")) { parse_comparison(); emit(logical_and); }
+	}
+
+	void parse_comparison() {
+		parse_term();
+		static const std::pair<const char*, op_kind> operators[] = {
+			{ "==", equal }, { "!=", not_equal }, { "<=", less_equal }, { ">=", greater_equal }, { "<", less }, { ">", greater } };
+		for (auto& [token, kind] : operators) {
+			if (!accept(token)) continue;
+			parse_term();
+			emit(kind);
+			return;
+		}
+	}
+
+	void parse_term() {
+		static const char* names[] = {
+			"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+			"a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6" };
+		skip_spaces();
+		if (accept("(")) {
+			parse_or();
+			if (!accept(")")) throw std::runtime_error("Missing ')' in condition");
+			return;
+		}
+		if (accept("mem[")) {
+			parse_or();
+			if (!accept("]")) throw std::runtime_error("Missing ']' in condition");
+			emit(load_memory);
+			return;
+		}
+		if (*cursor == '-' || isdigit((unsigned char)*cursor)) {
+			char* end = nullptr;
+			uint32_t value = uint32_t(strtoll(cursor, &end, 0));
+			if (end == cursor || isalnum((unsigned char)*end) || *end == '_') {
+				if (end == cursor) end++;
+				while (isalnum((unsigned char)*end) || *end == '_') end++;
+				throw std::runtime_error("Bad number '" + std::string(cursor, (const char*)end) + "' in condition");
+			}
+			emit(push_constant, value);
+			cursor = end;
+			return;
+		}
+
+		// Whole names only, so x5a or a0b is an error rather than x5 or a0
+		const char* start = cursor;
+		while (isalnum((unsigned char)*cursor) || *cursor == '_') cursor++;
+		std::string name(start, cursor);
+		if (name == "pc") return emit(push_pc);
+		if (name == "fp") return emit(push_register, 8);
+		for (uint32_t i = 0; i < 32; i++)
+			if (name == names[i] || name == "x" + std::to_string(i)) return emit(push_register, i);
+		throw std::runtime_error("Unknown operand '" + name + "' in condition");
+	}
+
+	std::string text;
+	const char* cursor = nullptr;
+	std::vector<op> program;
+	int depth = 0;
+	int max_depth = 0;
+};
+
+// Breakpoints with optional conditions, checked through the pc bitmap first.
+class breakpoint_set {
+public:
+	void insert(uint32_t pc, condition cond = {}) {
+		addresses.insert(pc);
+		if (cond.empty()) conditions.erase(pc);
+		else conditions[pc] = std::move(cond);
+	}
+
+	void erase(uint32_t pc) {
+		addresses.erase(pc);
+		conditions.erase(pc);
+	}
+
+	bool should_stop(uint32_t pc, const int32_t* registers, const std::vector<uint32_t>& memory) const {
+		if (!addresses.test(pc)) return false;
+		auto it = conditions.find(pc);
+		return it == conditions.end() || it->second.evaluate(registers, pc, memory);
+	}
+
+	pc_bitmap addresses;
+
+private:
+	std::unordered_map<uint32_t, condition> conditions;
+};
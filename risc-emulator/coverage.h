@@ -0,0 +1,208 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <array>
+#include <vector>
+#include <string>
+#include <bit>
+#include <fstream>
+#include <stdexcept>
+#include "isa.h"
+
+// Which parts of the instruction encoding space a guest has exercised.
+//
+// Three bitmaps, all updated by record() once per retired instruction:
+//  - every (opcode, funct3, funct7) combination seen, with funct7 taken as
+//    zero where it holds immediate bits
+//  - per instruction, the operand and immediate edge cases it ran with:
+//    rd or rs1 being x0, rs1 == rs2, and the immediate being zero, positive,
+//    negative or at either end of its field (backward branches are negative
+//    imm_b, imm_j at +-1MiB are the longest jal reach)
+//  - the RV32C quadrant/funct3 forms that were expanded
+//
+// A map only ever gains bits, so maps from separate runs, harts or fuzzer
+// threads combine with merge() and the result does not depend on order.
+// save() and load() move them between processes.
+class instruction_coverage {
+public:
+	static constexpr size_t instruction_count = isa::count;
+
+	enum edge : uint32_t {
+		executed, rd_zero, rs1_zero, same_sources, imm_zero, imm_positive, imm_negative, imm_min, imm_max, compressed,
+		edge_count
+	};
+	static constexpr const char* edge_names[edge_count] = {
+		"exec", "rd=0", "rs1=0", "rs1=rs2", "imm=0", "imm>0", "imm<0", "min", "max", "rvc" };
+
+	// Indexed by (quadrant << 3) | funct3 of the 16-bit parcel, null where RV32C has nothing this emulator expands.
+	static constexpr const char* compressed_names[24] = {
+		"c.addi4spn", nullptr, "c.lw", nullptr, nullptr, nullptr, "c.sw", nullptr,
+		"c.addi", "c.jal", "c.li", "c.lui/addi16sp", "c.alu", "c.j", "c.beqz", "c.bnez",
+		"c.slli", nullptr, "c.lwsp", nullptr, "c.jr/mv/add", nullptr, "c.swsp", nullptr };
+
+	// `instruction` is what was executed, `fetched` what was in memory, the
+	// two differ for expanded RV32C parcels.
+	void record(uint32_t instruction, uint32_t fetched) {
+		uint32_t key = isa::decode_key(instruction);
+		uint8_t id = isa::decode(instruction);
+		if (id != isa::invalid) {
+			// Immediate bits, not part of the encoding: funct7 unless it selects
+			// the instruction, and funct3 as well for lui, auipc and jal
+			auto type = isa::table[id].type;
+			if (type == isa::format::u || type == isa::format::j)
+				key &= ~0x3ffu;
+			else if (!isa::table[id].funct7_mask)
+				key &= ~0x7fu;
+		}
+		set(encodings[key >> 6], uint64_t(1) << (key & 63));
+		if (id == isa::invalid) return;
+		uint32_t mask = edge_mask(isa::table[id], instruction);
+		if ((fetched & 0b11) != 0b11) {
+			mask |= 1u << compressed;
+			set(compressed_forms, 1u << (((fetched & 0b11) << 3) | ((fetched >> 13) & 0b111)));
+		}
+		set(edges[id], mask);
+	}
+
+	// Returns how many bits `other` added.
+	uint64_t merge(const instruction_coverage& other) {
+		uint64_t before = new_bits;
+		for (size_t i = 0; i < encodings.size(); i++) set(encodings[i], other.encodings[i]);
+		for (size_t i = 0; i < edges.size(); i++) set(edges[i], other.edges[i]);
+		set(compressed_forms, other.compressed_forms);
+		return new_bits - before;
+	}
+
+	// Bits gained since construction, only ever grows.
+	uint64_t new_bits = 0;
+
+	void save(const std::string& path) const {
+		std::ofstream file(path, std::ios::binary);
+		if (!file)
+			throw std::runtime_error("Cannot write coverage file '" + path + "'");
+		uint32_t header[4] = { magic, version, uint32_t(encodings.size()), uint32_t(edges.size()) };
+		file.write((const char*)header, sizeof(header));
+		file.write((const char*)encodings.data(), encodings.size() * sizeof(encodings[0]));
+		file.write((const char*)edges.data(), edges.size() * sizeof(edges[0]));
+		file.write((const char*)&compressed_forms, sizeof(compressed_forms));
+		if (!file)
+			throw std::runtime_error("Cannot write coverage file '" + path + "'");
+	}
+
+	// Merges a file written by save(), refusing ones built from another instruction table.
+	void load(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+			throw std::runtime_error("Cannot open coverage file '" + path + "'");
+		uint32_t header[4] = {};
+		file.read((char*)header, sizeof(header));
+		if (header[0] != magic || header[1] != version || header[2] != encodings.size() || header[3] != edges.size())
+			throw std::runtime_error("'" + path + "' is not a coverage file from this emulator version");
+		instruction_coverage other;
+		file.read((char*)other.encodings.data(), other.encodings.size() * sizeof(other.encodings[0]));
+		file.read((char*)other.edges.data(), other.edges.size() * sizeof(other.edges[0]));
+		file.read((char*)&other.compressed_forms, sizeof(other.compressed_forms));
+		if (!file)
+			throw std::runtime_error("Coverage file '" + path + "' is truncated");
+		merge(other);
+	}
+
+	// Merges into an existing file, or starts it, so repeated runs accumulate.
+	void accumulate(const std::string& path) const {
+		instruction_coverage total = *this;
+		if (std::ifstream(path).good())
+			total.load(path);
+		total.save(path);
+	}
+
+	void summary(FILE* out) const {
+		uint32_t executed_count = 0, edges_hit = 0, edges_total = 0, forms_total = 0;
+		for (size_t i = 0; i < instruction_count; i++) {
+			executed_count += edges[i] & 1;
+			edges_hit += std::popcount(edges[i] & applicable(isa::table[i]));
+			edges_total += std::popcount(applicable(isa::table[i]));
+		}
+		for (auto name : compressed_names) forms_total += name != nullptr;
+		uint64_t distinct = 0;
+		for (auto word : encodings) distinct += std::popcount(word);
+		fprintf(out, "Coverage: %u/%zu instructions, %u/%u edge cases, %d/%u compressed forms, %llu distinct encodings\n",
+			executed_count, instruction_count, edges_hit, edges_total, std::popcount(compressed_forms), forms_total,
+			(unsigned long long)distinct);
+	}
+
+	// One row per instruction: x covered, . not yet, blank where the case does not apply.
+	void report(FILE* out) const {
+		summary(out);
+		fprintf(out, "\n%-10s %s", "", " ");
+		for (auto name : edge_names) fprintf(out, " %-7s", name);
+		fprintf(out, "\n");
+		for (size_t i = 0; i < instruction_count; i++) {
+			uint32_t possible = applicable(isa::table[i]);
+			fprintf(out, "%-10s %c", isa::table[i].name, char(isa::table[i].type));
+			for (uint32_t e = 0; e < edge_count; e++)
+				fprintf(out, " %-7c", !(possible & (1u << e)) ? ' ' : edges[i] & (1u << e) ? 'x' : '.');
+			fprintf(out, "\n");
+		}
+
+		fprintf(out, "\nNot executed:");
+		for (size_t i = 0; i < instruction_count; i++)
+			if (!(edges[i] & 1)) fprintf(out, " %s", isa::table[i].name);
+		fprintf(out, "\nCompressed forms not seen:");
+		for (uint32_t i = 0; i < 24; i++)
+			if (compressed_names[i] && !(compressed_forms & (1u << i))) fprintf(out, " %s", compressed_names[i]);
+		fprintf(out, "\n");
+	}
+
+	bool executed_instruction(size_t id) const { return edges[id] & 1; }
+	uint32_t edges_of(size_t id) const { return edges[id]; }
+
+private:
+	static constexpr uint32_t magic = 0x564f4352;	// "RCOV"
+	static constexpr uint32_t version = 1;
+	// rvc only counts for the rows an RV32C parcel can expand to
+	static constexpr uint32_t applicable(const isa::instruction& row) {
+		constexpr uint32_t rd = 1u << rd_zero, rs1 = 1u << rs1_zero, both = 1u << same_sources;
+		constexpr uint32_t imm = (1u << imm_zero) | (1u << imm_positive) | (1u << imm_negative) | (1u << imm_min) | (1u << imm_max);
+		const uint32_t always = (1u << executed) | (uint32_t(row.compressed) << compressed);
+		switch (row.type) {
+		case isa::format::r: case isa::format::amo: return always | rd | rs1 | both;
+		case isa::format::i: return always | rd | rs1 | imm;
+		case isa::format::shift: return always | rd | rs1 | (imm & ~(1u << imm_negative));
+		case isa::format::s: case isa::format::b: return always | rs1 | both | imm;
+		case isa::format::u: case isa::format::j: return always | rd | imm;
+		default: return always;
+		}
+	}
+
+	static uint32_t edge_mask(const isa::instruction& row, uint32_t instruction) {
+		isa::format format = row.type;
+		uint32_t rd = isa::rd(instruction), rs1 = isa::rs1(instruction), rs2 = isa::rs2(instruction);
+		int32_t imm = 0, lowest = 0, highest = 0;
+		switch (format) {
+		case isa::format::i: imm = isa::immediate<isa::format::i>(instruction); lowest = -2048; highest = 2047; break;
+		case isa::format::shift: imm = isa::immediate<isa::format::shift>(instruction); lowest = 0; highest = 31; break;
+		case isa::format::s: imm = isa::immediate<isa::format::s>(instruction); lowest = -2048; highest = 2047; break;
+		case isa::format::b: imm = isa::immediate<isa::format::b>(instruction); lowest = -4096; highest = 4094; break;
+		case isa::format::u: imm = isa::immediate<isa::format::u>(instruction); lowest = INT32_MIN; highest = 0x7ffff000; break;
+		case isa::format::j: imm = isa::immediate<isa::format::j>(instruction); lowest = -1048576; highest = 1048574; break;
+		default: break;
+		}
+		uint32_t mask = (1u << executed) | (uint32_t(rd == 0) << rd_zero) | (uint32_t(rs1 == 0) << rs1_zero) |
+			(uint32_t(rs1 == rs2) << same_sources) | (uint32_t(imm == 0) << imm_zero) | (uint32_t(imm > 0) << imm_positive) |
+			(uint32_t(imm < 0) << imm_negative) | (uint32_t(imm == lowest) << imm_min) | (uint32_t(imm == highest) << imm_max);
+		return mask & applicable(row);
+	}
+
+	template <typename T>
+	void set(T& word, T bits) {
+		T gained = bits & ~word;
+		if (!gained) return;
+		word |= gained;
+		new_bits += std::popcount(gained);
+	}
+
+	std::array<uint64_t, (1 << 15) / 64> encodings{};
+	std::array<uint32_t, instruction_count> edges{};
+	uint32_t compressed_forms = 0;
+};
@@ -0,0 +1,629 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <array>
+#include <utility>
+#include "branch_predictor.h"
+#include "time_travel.h"
+#include "breakpoints.h"
+#include "register_display.h"
+#include "coverage.h"
+#include "isa.h"
+#include "reservation_set.h"
+
+// How data memory accesses are ordered between harts. A single hart uses
+// plain loads and stores; with several harts every access goes through
+// std::atomic_ref with the chosen order, and fence is a full host fence
+// under relaxed and acqrel.
+enum class memory_ordering : uint8_t { single, relaxed, acquire_release, sequential };
+
+class cpu_risc32i {
+
+public:
+
+	cpu_risc32i() : cpu_risc32i(4096) {}
+
+	cpu_risc32i(uint32_t memory_size)
+		: program_image(std::make_shared<std::vector<uint32_t>>(memory_size)), data_image(std::make_shared<std::vector<uint32_t>>()),
+		memory(*program_image), isolated_memory(*data_image) {
+		reset();
+	}
+
+	// Another hart sharing `boot`'s program and data memory, one of
+	// `hart_count`. Its stack sits above the previous hart's, see stack_top(),
+	// and tp holds the hart id.
+	cpu_risc32i(cpu_risc32i& boot, uint32_t hart_id, uint32_t hart_count)
+		: program_image(boot.program_image), data_image(boot.data_image), memory(*program_image), isolated_memory(*data_image),
+		hartId(hart_id), hartCount(hart_count), pc(0) {
+		reset_registers();
+	}
+
+	// For the boot hart once the others exist, moves its stack to its share.
+	void share_memory(uint32_t hart_count) {
+		hartCount = hart_count;
+		registers.alias.sp = int32_t(stack_top());
+	}
+
+	// Clears both memories, so only the boot hart should call this.
+	void reset(uint32_t reset_pc = 0) {
+		this->pc = reset_pc;
+		reset_registers();
+		// clear memory
+		for (auto& i : memory) i = 0;
+		isolated_memory = memory;
+	}
+
+	void load_program(uint32_t offset, const std::vector<uint32_t>& bin) {
+		for (uint32_t i = 0; i < std::min(bin.size(), memory.size()); i++)
+			memory[i + offset] = bin.at(i); // throws exception if out of bounds
+		isolated_memory = memory;
+	}
+
+	// step() plus a rate limited register display frame.
+	uint32_t cycle() {
+		uint32_t instruction = step();
+		display.frame(registers.REG, pc, cycleCount);
+		return instruction;
+	}
+
+	// Executes one instruction without presenting the register state.
+	uint32_t step() {
+		cycleCount++;
+
+		// 1) Read instruction at PC
+		int32_t pc = this->pc;
+		uint32_t fetched = fetch_instruction(pc);
+		uint32_t instruction = fetched;
+
+		if (!instruction)
+			return instruction;
+
+		// RV32C: 16-bit parcels are expanded into their 32-bit equivalent so
+		// the decoder below only ever sees base encodings.
+		uint32_t ilen = 4;
+		if ((instruction & 0b11) != 0b11) {
+			instruction = expand_compressed(uint16_t(instruction));
+			ilen = 2;
+			fetchStats.compressed++;
+		}
+		fetchStats.instructions++;
+		fetchStats.bytes += ilen;
+
+		// 2) Decode instruction, one table load picks the handler generated for it
+		uint32_t rd = isa::rd(instruction);
+		uint8_t id = isa::decode(instruction);
+
+		registers.alias.zero = 0;
+
+		if (timeTravel)
+			timeTravel->record_instruction(pc, cycleCount - 1, registers.REG, rd);
+
+		// 3) Execute instruction
+		handlers()[id](*this, instruction, pc, ilen);
+
+		if (coverage)
+			coverage->record(instruction, fetched);
+
+		registers.alias.zero = 0;
+		return fetched;
+	}
+
+	uint32_t get_pc() const { return pc; }
+	uint32_t hart_id() const { return hartId; }
+	void set_pc(uint32_t new_pc) { pc = new_pc; }
+
+	// Instruction memory is fetched by byte address (pc >> 2), data memory is
+	// what loads and stores see.
+	std::vector<uint32_t>& program_memory() { return memory; }
+	std::vector<uint32_t>& data_memory() { return isolated_memory; }
+
+	// Steps back `count` instructions (bounded by the recorded history) and
+	// returns how many were actually undone. Requires timeTravel.
+	uint64_t reverse_step(uint64_t count) {
+		uint64_t position = timeTravel->get_position();
+		uint64_t target = position - std::min(count, position - timeTravel->oldest_position());
+		reverse_to(target);
+		return position - target;
+	}
+
+	// Runs backwards until stop() holds for the state in front of an earlier
+	// instruction, or until in front of a store that fires a watchpoint. Each
+	// checkpoint interval is replayed forward once to find the last matching
+	// position in it, so the cost is one replay per interval.
+	bool reverse_continue(const std::function<bool()>& stop) {
+		uint64_t end = timeTravel->get_position();
+		while (end > timeTravel->oldest_position()) {
+			uint64_t start = timeTravel->checkpoint_before(end);
+			reverse_to(start);
+			uint64_t hit = end;
+			while (timeTravel->get_position() < end) {
+				uint64_t position = timeTravel->get_position();
+				if (stop()) hit = position;
+				stopRequested = false;
+				replay_to(position + 1, true);
+				if (stopRequested) hit = position;
+			}
+			stopRequested = false;
+			if (hit != end) {
+				reverse_to(hit);
+				return true;
+			}
+			reverse_to(start);
+			end = start;
+		}
+		return false;
+	}
+
+	// Instructions are only required to be halfword aligned once RV32C is in
+	// play, so a 32-bit instruction may straddle two memory words.
+	uint32_t fetch_instruction(uint32_t pc) const {
+		uint32_t word = memory[pc >> 2];
+		if (!(pc & 2))
+			return (word & 0b11) == 0b11 ? word : word & 0x0000ffff;
+		uint32_t parcel = word >> 16;
+		if ((parcel & 0b11) != 0b11)
+			return parcel;
+		return parcel | (memory[((pc >> 2) + 1) % memory.size()] << 16);
+	}
+
+	// Expands a 16-bit RV32C parcel into the equivalent RV32I instruction.
+	static uint32_t expand_compressed(uint16_t parcel) {
+		uint32_t c = parcel;
+		auto bits = [c](int hi, int lo) { return (c >> lo) & ((1u << (hi - lo + 1)) - 1); };
+		auto sext = [](uint32_t value, int width) { return int32_t(value << (32 - width)) >> (32 - width); };
+
+		auto make_r = [](uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd) {
+			return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode::rtype;
+		};
+		auto make_i = [](uint32_t op, uint32_t rd, uint32_t funct3, uint32_t rs1, int32_t imm) {
+			return (uint32_t(imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | op;
+		};
+		auto make_s = [](uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+			return (uint32_t((imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (uint32_t(imm & 0x1f) << 7) | opcode::stype;
+		};
+		auto make_b = [](uint32_t funct3, uint32_t rs1, int32_t imm) {
+			return (uint32_t((imm >> 12) & 1) << 31) | (uint32_t((imm >> 5) & 0x3f) << 25) | (rs1 << 15) | (funct3 << 12) |
+				(uint32_t((imm >> 1) & 0xf) << 8) | (uint32_t((imm >> 11) & 1) << 7) | opcode::btype;
+		};
+		auto make_j = [](uint32_t rd, int32_t imm) {
+			return (uint32_t((imm >> 20) & 1) << 31) | (uint32_t((imm >> 1) & 0x3ff) << 21) | (uint32_t((imm >> 11) & 1) << 20) |
+				(uint32_t((imm >> 12) & 0xff) << 12) | (rd << 7) | opcode::jal;
+		};
+
+		uint32_t funct3 = bits(15, 13);
+		uint32_t rd = bits(11, 7);			// full register fields (quadrants 1 and 2)
+		uint32_t rs2 = bits(6, 2);
+		uint32_t rd_p = 8 + bits(4, 2);		// x8-x15 register fields (rd', rs2')
+		uint32_t rs1_p = 8 + bits(9, 7);	// rs1' / rd'
+		int32_t imm6 = sext((bits(12, 12) << 5) | bits(6, 2), 6);
+		int32_t imm_cj = sext((bits(12, 12) << 11) | (bits(11, 11) << 4) | (bits(10, 9) << 8) | (bits(8, 8) << 10) |
+			(bits(7, 7) << 6) | (bits(6, 6) << 7) | (bits(5, 3) << 1) | (bits(2, 2) << 5), 12);
+		int32_t imm_cb = sext((bits(12, 12) << 8) | (bits(11, 10) << 3) | (bits(6, 5) << 6) | (bits(4, 3) << 1) | (bits(2, 2) << 5), 9);
+		uint32_t uimm_lw = (bits(12, 10) << 3) | (bits(6, 6) << 2) | (bits(5, 5) << 6);
+
+		switch ((bits(1, 0) << 3) | funct3) {
+		// Quadrant 0
+		case 0b00000 /* c.addi4spn */: {
+			uint32_t nzuimm = (bits(12, 11) << 4) | (bits(10, 7) << 6) | (bits(6, 6) << 2) | (bits(5, 5) << 3);
+			if (!nzuimm) break;
+			return make_i(opcode::itype, rd_p, 0b000, 2, nzuimm);
+		}
+		case 0b00010 /* c.lw */: return make_i(opcode::itype_mem, rd_p, 0b010, rs1_p, uimm_lw);
+		case 0b00110 /* c.sw */: return make_s(0b010, rs1_p, rd_p, uimm_lw);
+		// Quadrant 1
+		case 0b01000 /* c.addi / c.nop */: return make_i(opcode::itype, rd, 0b000, rd, imm6);
+		case 0b01001 /* c.jal */: return make_j(1, imm_cj);
+		case 0b01010 /* c.li */: return make_i(opcode::itype, rd, 0b000, 0, imm6);
+		case 0b01011 /* c.addi16sp / c.lui */: {
+			if (rd == 2) {
+				int32_t nzimm = sext((bits(12, 12) << 9) | (bits(6, 6) << 4) | (bits(5, 5) << 6) | (bits(4, 3) << 7) | (bits(2, 2) << 5), 10);
+				if (!nzimm) break;
+				return make_i(opcode::itype, 2, 0b000, 2, nzimm);
+			}
+			if (!imm6) break;
+			return (uint32_t(imm6) << 12) | (rd << 7) | opcode::lui;
+		}
+		case 0b01100 /* c.srli / c.srai / c.andi / c.sub / c.xor / c.or / c.and */:
+			switch (bits(11, 10)) {
+			case 0b00 /* c.srli */: if (bits(12, 12)) break; return make_i(opcode::itype, rs1_p, 0b101, rs1_p, rs2);
+			case 0b01 /* c.srai */: if (bits(12, 12)) break; return make_i(opcode::itype, rs1_p, 0b101, rs1_p, 0x400 | rs2);
+			case 0b10 /* c.andi */: return make_i(opcode::itype, rs1_p, 0b111, rs1_p, imm6);
+			case 0b11:
+				if (bits(12, 12)) break; // c.subw/c.addw are RV64 only
+				switch (bits(6, 5)) {
+				case 0b00 /* c.sub */: return make_r(0b0100000, rd_p, rs1_p, 0b000, rs1_p);
+				case 0b01 /* c.xor */: return make_r(0, rd_p, rs1_p, 0b100, rs1_p);
+				case 0b10 /* c.or  */: return make_r(0, rd_p, rs1_p, 0b110, rs1_p);
+				case 0b11 /* c.and */: return make_r(0, rd_p, rs1_p, 0b111, rs1_p);
+				}
+			}
+			break;
+		case 0b01101 /* c.j */: return make_j(0, imm_cj);
+		case 0b01110 /* c.beqz */: return make_b(0b000, rs1_p, imm_cb);
+		case 0b01111 /* c.bnez */: return make_b(0b001, rs1_p, imm_cb);
+		// Quadrant 2
+		case 0b10000 /* c.slli */: if (bits(12, 12)) break; return make_i(opcode::itype, rd, 0b001, rd, rs2);
+		case 0b10010 /* c.lwsp */: {
+			if (!rd) break;
+			uint32_t uimm = (bits(12, 12) << 5) | (bits(6, 4) << 2) | (bits(3, 2) << 6);
+			return make_i(opcode::itype_mem, rd, 0b010, 2, uimm);
+		}
+		case 0b10100 /* c.jr / c.mv / c.jalr / c.add */:
+			if (!bits(12, 12)) {
+				if (!rs2) {
+					if (!rd) break;
+					return make_i(opcode::jalr, 0, 0b000, rd, 0);	// c.jr
+				}
+				return make_r(0, rs2, 0, 0b000, rd);				// c.mv
+			}
+			if (!rs2) {
+				if (!rd) break;										// c.ebreak, no system instructions yet
+				return make_i(opcode::jalr, 1, 0b000, rd, 0);		// c.jalr
+			}
+			return make_r(0, rs2, rd, 0b000, rd);					// c.add
+		case 0b10110 /* c.swsp */: {
+			uint32_t uimm = (bits(12, 9) << 2) | (bits(8, 7) << 6);
+			return make_s(0b010, 2, rs2, uimm);
+		}
+		}
+		throw std::runtime_error("Invalid or unsupported compressed instruction encountered.");
+	}
+
+	// Forces a full-rate frame, for after single steps and console commands.
+	void display_registers() const {
+		display.draw(registers.REG, pc, cycleCount);
+	}
+
+
+public:
+	// The encodings live in isa.h, these keep cpu_risc32i::btype and friends working
+	using opcode = isa::opcode;
+	using enum isa::opcode;
+
+	struct register_file {
+		union {
+			int32_t REG[32];
+			struct {
+				/* x0  */ int32_t zero;
+				/* x1  */ int32_t ra;  // return address	(Saved by caller)
+				/* x2  */ int32_t sp;  // stack pointer	(Saved by callee)
+				/* x3  */ int32_t gp;  // global pointer
+				/* x4  */ int32_t tp;  // thread pointer
+				/* x5  */ int32_t t0;  // temporary / alternate return address (Saved by caller)
+				/* x6  */ int32_t t1;  // temporary (Saved by caller)
+				/* x7  */ int32_t t2;  // temporary (Saved by caller)
+				/* x8  */ int32_t s0;  // Saved register / frame pointer (Saved by caller)
+				/* x9  */ int32_t s1;  // Saved register (Saved by caller)
+				/* x10 */ int32_t a0;  // Function argument / return value (Caller)
+				/* x11 */ int32_t a1;  // Function argument / return value (Caller)
+				/* x12 */ int32_t a2;  // Function argument
+				/* x13 */ int32_t a3;  // Function argument
+				/* x14 */ int32_t a4;  // Function argument
+				/* x15 */ int32_t a5;  // Function argument
+				/* x16 */ int32_t a6;  // Function argument
+				/* x17 */ int32_t a7;  // Function argument
+				/* x18 */ int32_t s2;  // Saved register
+				/* x19 */ int32_t s3;  // Saved register
+				/* x20 */ int32_t s4;  // Saved register
+				/* x21 */ int32_t s5;  // Saved register
+				/* x22 */ int32_t s6;  // Saved register
+				/* x23 */ int32_t s7;  // Saved register
+				/* x24 */ int32_t s8;  // Saved register
+				/* x25 */ int32_t s9;  // Saved register
+				/* x26 */ int32_t s10; // Saved register
+				/* x27 */ int32_t s11; // Saved register
+				/* x28 */ int32_t t3;  // Temporary
+				/* x29 */ int32_t t4;  // Temporary
+				/* x30 */ int32_t t5;  // Temporary
+				/* x31 */ int32_t t6;  // Temporary
+			} alias;
+		};
+	};
+
+	// Instruction fetch counters, used to measure RV32C code density.
+	struct fetch_stats {
+		uint64_t instructions = 0;	// retired instructions
+		uint64_t compressed = 0;	// of which were 16-bit parcels
+		uint64_t bytes = 0;			// bytes pulled through instruction fetch
+	};
+public:
+	register_file registers;
+	uint64_t cycleCount = 0;
+	fetch_stats fetchStats;
+	branch_model* branchModel = nullptr; // optional, observes every control transfer
+	time_travel* timeTravel = nullptr; // optional, records history for reverse execution
+	watchpoint_set* watchpoints = nullptr; // optional, checked on stores into watched pages
+	instruction_coverage* coverage = nullptr; // optional, marks each retired encoding and its operand edge cases
+	bool stopRequested = false; // set when a watchpoint fires, cleared by whoever runs the cpu
+	mutable register_display display;
+	memory_ordering ordering = memory_ordering::single; // set for every hart when more than one shares memory
+	reservation_set* reservations = nullptr;			// likewise, shared by those harts
+
+protected:
+	void reverse_to(uint64_t target) {
+		if (target >= timeTravel->newest_checkpoint()) {
+			while (timeTravel->get_position() > target && timeTravel->can_undo())
+				timeTravel->undo(registers.REG, pc, cycleCount, isolated_memory);
+			return;
+		}
+		timeTravel->restore(target, registers.REG, pc, cycleCount, isolated_memory);
+		replay_to(target);
+	}
+
+	// Re-executes recorded history, observers other than the recorder stay detached.
+	void replay_to(uint64_t target, bool keep_watchpoints = false) {
+		auto model = branchModel;
+		auto watches = watchpoints;
+		branchModel = nullptr;
+		if (!keep_watchpoints) watchpoints = nullptr;
+		while (timeTravel->get_position() < target)
+			step();
+		branchModel = model;
+		watchpoints = watches;
+	}
+
+	void reset_registers() {
+		for (int i = 0; i < 32; i++)
+			registers.REG[i] = 0;
+		registers.alias.sp = int32_t(stack_top());
+		registers.alias.tp = hartId;
+	}
+
+	// Each hart gets an equal stack of at most 1024 words, stacked from the
+	// bottom of memory, so they neither overlap nor wrap however small it is.
+	// A lone hart on a big enough memory keeps sp = 1024.
+	uint32_t stack_top() const {
+		uint32_t stack = std::min<uint32_t>(1024, uint32_t(memory.size()) / hartCount);
+		return stack * (hartId + 1);
+	}
+
+	std::memory_order load_order() const {
+		return ordering == memory_ordering::sequential ? std::memory_order_seq_cst :
+			ordering == memory_ordering::acquire_release ? std::memory_order_acquire : std::memory_order_relaxed;
+	}
+
+	std::memory_order store_order() const {
+		return ordering == memory_ordering::sequential ? std::memory_order_seq_cst :
+			ordering == memory_ordering::acquire_release ? std::memory_order_release : std::memory_order_relaxed;
+	}
+
+	uint32_t load_word(uint32_t index) {
+		if (ordering == memory_ordering::single)
+			return isolated_memory[index];
+		return std::atomic_ref<uint32_t>(isolated_memory[index]).load(load_order());
+	}
+
+	// sb and sh replace the low bits of the word, which is a read-modify-write
+	// another hart could interleave with, hence the compare-exchange.
+	void store_word(uint32_t index, uint32_t value, uint32_t mask) {
+		uint32_t& word = isolated_memory[index];
+		if (ordering == memory_ordering::single) {
+			word = (word & ~mask) | (value & mask);
+			return;
+		}
+		std::atomic_ref<uint32_t> shared(word);
+		if (mask == 0xffffffff)
+			shared.store(value, store_order());
+		else {
+			uint32_t expected = shared.load(std::memory_order_relaxed);
+			while (!shared.compare_exchange_weak(expected, (expected & ~mask) | (value & mask), store_order(), std::memory_order_relaxed)) {}
+		}
+		if (reservations)
+			reservations->stored(hartId, index);
+	}
+
+	// Returns the value for rd. Atomics are always sequentially consistent,
+	// which satisfies any combination of the aq/rl bits. With other harts on
+	// the same memory, reservations live in the shared reservation_set and
+	// any store from another hart breaks them.
+	uint32_t atomic_memory_operation(uint32_t funct5, uint32_t index, int32_t operand) {
+		uint32_t result = atomic_read_modify_write(funct5, index, operand);
+		if (reservations && funct5 != 0b00010 && funct5 != 0b00011)
+			reservations->stored(hartId, index);
+		return result;
+	}
+
+	uint32_t atomic_read_modify_write(uint32_t funct5, uint32_t index, int32_t operand) {
+		std::atomic_ref<uint32_t> word(isolated_memory[index]);
+		uint32_t value = uint32_t(operand);
+		auto update = [&](auto combine) {
+			uint32_t expected = word.load();
+			while (!word.compare_exchange_weak(expected, combine(expected))) {}
+			return expected;
+		};
+
+		switch (funct5) {
+		case 0b00010 /* lr.w */:
+			if (reservations)
+				return reservations->reserve(hartId, word, index);
+			reservation = index;
+			reservationValid = true;
+			return word.load();
+		case 0b00011 /* sc.w */: {
+			if (reservations)
+				return reservations->conditional_store(hartId, word, index, value) ? 0 : 1;
+			bool success = reservationValid && reservation == index;
+			reservationValid = false;
+			if (success) word.store(value);
+			return success ? 0 : 1;
+		}
+		case 0b00001 /* amoswap.w */: return word.exchange(value);
+		case 0b00000 /* amoadd.w  */: return word.fetch_add(value);
+		case 0b00100 /* amoxor.w  */: return word.fetch_xor(value);
+		case 0b01100 /* amoand.w  */: return word.fetch_and(value);
+		case 0b01000 /* amoor.w   */: return word.fetch_or(value);
+		case 0b10000 /* amomin.w  */: return update([=](uint32_t old) { return int32_t(old) < operand ? old : value; });
+		case 0b10100 /* amomax.w  */: return update([=](uint32_t old) { return int32_t(old) > operand ? old : value; });
+		case 0b11000 /* amominu.w */: return update([=](uint32_t old) { return std::min(old, value); });
+		case 0b11100 /* amomaxu.w */: return update([=](uint32_t old) { return std::max(old, value); });
+		}
+		throw std::runtime_error("Invalid atomic memory operation.");
+	}
+
+	using handler = void (*)(cpu_risc32i& cpu, uint32_t instruction, int32_t pc, uint32_t ilen);
+
+	template <size_t... Row>
+	static constexpr std::array<handler, 256> make_handlers(std::index_sequence<Row...>) {
+		std::array<handler, 256> table{};
+		for (auto& entry : table) entry = &invalid_instruction;
+		((table[Row] = &execute<isa::mnemonic(Row)>), ...);
+		return table;
+	}
+
+	// Indexed by isa::decode(), rows past the table and isa::invalid throw.
+	static const handler* handlers() {
+		static constexpr auto table = make_handlers(std::make_index_sequence<isa::count>());
+		return table.data();
+	}
+
+	// One instantiation per isa::table row: the immediate extraction of its
+	// format and its operation are fixed at compile time, so the only branches
+	// left are the optional hooks and the guest's own.
+	template <isa::mnemonic M>
+	static void execute(cpu_risc32i& cpu, uint32_t instruction, int32_t pc, uint32_t ilen) {
+		using isa::mnemonic;
+		constexpr isa::format F = isa::info(M).type;
+		constexpr uint8_t op = isa::info(M).opcode;
+		int32_t* x = cpu.registers.REG;
+		uint32_t rd = isa::rd(instruction), rs1 = isa::rs1(instruction), rs2 = isa::rs2(instruction);
+		int32_t imm = isa::immediate<F>(instruction);
+		uint32_t next = pc + ilen;
+
+		if constexpr (M == mnemonic::lui)
+			x[rd] = imm;
+		else if constexpr (M == mnemonic::auipc)
+			x[rd] = imm + pc;
+		else if constexpr (M == mnemonic::jal) {
+			// rd <- pc + ilen, pc <- pc + imm_j
+			next = (pc + imm) & ~1;
+			x[rd] = pc + ilen;
+			if (cpu.branchModel)
+				cpu.branchModel->jump(pc, next, rd, 0, ilen, false);
+		}
+		else if constexpr (M == mnemonic::jalr) {
+			// rd <- pc + ilen, pc <- (rs1 + imm_i) & ~1, target first in case rd == rs1
+			next = (x[rs1] + imm) & ~1;
+			x[rd] = pc + ilen;
+			if (cpu.branchModel)
+				cpu.branchModel->jump(pc, next, rd, rs1, ilen, true);
+		}
+		else if constexpr (F == isa::format::b) {
+			bool taken = compare<M>(x[rs1], x[rs2]);
+			if (taken) next = pc + imm;
+			if (cpu.branchModel)
+				cpu.branchModel->branch(pc, pc + imm, taken);
+		}
+		else if constexpr (op == isa::itype_mem) {
+			uint32_t data = cpu.load_word((uint32_t(x[rs1]) + uint32_t(imm)) % cpu.isolated_memory.size());
+			x[rd] = extend<M>(data);
+		}
+		else if constexpr (F == isa::format::s) {
+			constexpr uint32_t mask = M == mnemonic::sb ? 0x000000ff : M == mnemonic::sh ? 0x0000ffff : 0xffffffff;
+			uint32_t address = (uint32_t(x[rs1]) + uint32_t(imm)) % cpu.isolated_memory.size();
+			if (cpu.timeTravel)
+				cpu.timeTravel->record_store(cpu.isolated_memory, address);
+			cpu.store_word(address, x[rs2], mask);
+			if (cpu.watchpoints && cpu.watchpoints->watches_page(address))
+				cpu.stopRequested |= cpu.watchpoints->check(address, pc);
+		}
+		else if constexpr (F == isa::format::amo) {
+			// RV32A, word sized only
+			constexpr uint32_t funct5 = isa::info(M).funct7 >> 2;
+			constexpr bool writes = M != mnemonic::lr_w;
+			uint32_t address = uint32_t(x[rs1]) % cpu.isolated_memory.size();
+			if (writes && cpu.timeTravel)
+				cpu.timeTravel->record_store(cpu.isolated_memory, address);
+			x[rd] = int32_t(cpu.atomic_memory_operation(funct5, address, x[rs2]));
+			if (writes && cpu.watchpoints && cpu.watchpoints->watches_page(address))
+				cpu.stopRequested |= cpu.watchpoints->check(address, pc);
+		}
+		else if constexpr (F == isa::format::fence) {
+			// fence / fence.i; acquire loads and release stores still let a later
+			// load pass an earlier store, so only sc leaves nothing to order
+			if (cpu.ordering == memory_ordering::relaxed || cpu.ordering == memory_ordering::acquire_release)
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+		else if constexpr (F == isa::format::r)
+			x[rd] = alu<M>(x[rs1], x[rs2]);
+		else
+			x[rd] = alu<M>(x[rs1], imm);
+		cpu.pc = next;
+	}
+
+	// Register-register and register-immediate forms share their operation.
+	template <isa::mnemonic M>
+	static constexpr int32_t alu(int32_t a, int32_t b) {
+		using isa::mnemonic;
+		if constexpr (M == mnemonic::add || M == mnemonic::addi) return int32_t(uint32_t(a) + uint32_t(b));
+		else if constexpr (M == mnemonic::sub) return int32_t(uint32_t(a) - uint32_t(b));
+		else if constexpr (M == mnemonic::slt || M == mnemonic::slti) return a < b;
+		else if constexpr (M == mnemonic::sltu || M == mnemonic::sltiu) return uint32_t(a) < uint32_t(b);
+		else if constexpr (M == mnemonic::xor_ || M == mnemonic::xori) return a ^ b;
+		else if constexpr (M == mnemonic::or_ || M == mnemonic::ori) return a | b;
+		else if constexpr (M == mnemonic::and_ || M == mnemonic::andi) return a & b;
+		else if constexpr (M == mnemonic::sll || M == mnemonic::slli) return int32_t(uint32_t(a) << (b & 31));
+		else if constexpr (M == mnemonic::srl || M == mnemonic::srli) return int32_t(uint32_t(a) >> (b & 31));
+		else if constexpr (M == mnemonic::sra || M == mnemonic::srai) return a >> (b & 31);
+		else static_assert(M != M, "not an alu instruction");
+	}
+
+	template <isa::mnemonic M>
+	static constexpr bool compare(int32_t a, int32_t b) {
+		using isa::mnemonic;
+		if constexpr (M == mnemonic::beq) return a == b;
+		else if constexpr (M == mnemonic::bne) return a != b;
+		else if constexpr (M == mnemonic::blt) return a < b;
+		else if constexpr (M == mnemonic::bge) return a >= b;
+		else if constexpr (M == mnemonic::bltu) return uint32_t(a) < uint32_t(b);
+		else return uint32_t(a) >= uint32_t(b);
+	}
+
+	template <isa::mnemonic M>
+	static constexpr int32_t extend(uint32_t data) {
+		using isa::mnemonic;
+		if constexpr (M == mnemonic::lb) return int8_t(data);
+		else if constexpr (M == mnemonic::lh) return int16_t(data);
+		else if constexpr (M == mnemonic::lbu) return uint8_t(data);
+		else if constexpr (M == mnemonic::lhu) return uint16_t(data);
+		else return int32_t(data);
+	}
+
+	// Everything the decode table has no row for, with the old per-opcode messages.
+	static void invalid_instruction(cpu_risc32i&, uint32_t instruction, int32_t, uint32_t) {
+		switch (instruction & 0x7f) {
+		case btype: throw std::runtime_error("Invalid funct3 for branching.");
+		case itype_mem: throw std::runtime_error("Invalid funct3 for memory load (lb, lh, lw, lbu, lhu are only valid)");
+		case stype: throw std::runtime_error("Invalid funct3 for memory store (sb, sh, sw are only valid)");
+		case itype: throw std::runtime_error("Invalid shift encoding (funct7 must be 0 or 0b0100000).");
+		case rtype: throw std::runtime_error("Invalid r-type funct3/funct7.");
+		case amo:
+			if (isa::funct3(instruction) != 0b010)
+				throw std::runtime_error("Invalid funct3 for atomic memory operation (only .w is supported)");
+			throw std::runtime_error("Invalid atomic memory operation.");
+		}
+		throw std::runtime_error("Invalid instruction type encountered.");
+	}
+
+protected:
+	// Shared between harts, memory and isolated_memory refer into these.
+	std::shared_ptr<std::vector<uint32_t>> program_image;
+	std::shared_ptr<std::vector<uint32_t>> data_image;
+	std::vector<uint32_t>& memory;
+	std::vector<uint32_t>& isolated_memory;
+	uint32_t hartId = 0;
+	uint32_t hartCount = 1;	// harts sharing the memory, for stack_top()
+	uint32_t pc; // program counter
+
+	// lr.w/sc.w reservation of a hart that has the memory to itself
+	uint32_t reservation = 0;
+	bool reservationValid = false;
+
+};
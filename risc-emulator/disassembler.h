@@ -0,0 +1,201 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <charconv>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <stdexcept>
+#include "isa.h"
+#include "cpu_risc32i.h"
+
+// Label addresses written by the assembler's -map option, one
+// "<hex address> <name>" per line.
+class symbol_map {
+public:
+	void load(const std::string& path) {
+		std::ifstream file(path);
+		if (!file)
+			throw std::runtime_error("Cannot open label map '" + path + "'");
+		std::string address, name;
+		while (file >> address >> name)
+			names[uint32_t(std::stoul(address, nullptr, 16))] = name;
+	}
+
+	void add(uint32_t address, const std::string& name) { names[address] = name; }
+
+	// Null when nothing is labelled at `address`.
+	const std::string* at(uint32_t address) const {
+		auto it = names.find(address);
+		return it == names.end() ? nullptr : &it->second;
+	}
+
+	bool empty() const { return names.empty(); }
+
+private:
+	std::unordered_map<uint32_t, std::string> names;
+};
+
+// Turns instruction words back into the assembler's syntax, e.g.
+// "lw x24, -8(x2)" or "beq x5, x6, -16  # 0x30 <loop>". A labelled pc is
+// prefixed "<loop> "; there is never a ':' in the output, log-checker splits
+// emulator.log lines on the first one.
+//
+// Decoding is isa::decode()'s table lookup, and the operands are printed by a
+// function generated per isa::table row, so a word costs one load, one
+// indirect call and a few hundred bytes of straight-line formatting; no
+// snprintf. RV32C parcels are shown as the instruction they expand to.
+class disassembler {
+public:
+	static constexpr uint32_t no_pc = ~0u;	// branch and jal targets are then left relative
+
+	// ABI register names (a0, sp, ...) instead of the x0-x31 the assembler reads.
+	bool abi_names = false;
+	// Names branch and jal targets and labelled instructions, if set.
+	const symbol_map* symbols = nullptr;
+
+	// Writes at most `size` - 1 characters plus a terminator and returns the
+	// length. 96 bytes always suffices without symbols.
+	size_t format(uint32_t word, uint32_t pc, char* out, size_t size) const {
+		writer text{ out, out + size - 1 };
+		if (symbols && pc != no_pc)
+			if (auto label = symbols->at(pc)) {
+				text.put('<');
+				text.put(*label);
+				text.put("> ");
+			}
+
+		bool compressed = word && (word & 0b11) != 0b11;
+		if (compressed) {
+			try {
+				word = cpu_risc32i::expand_compressed(uint16_t(word));
+			}
+			catch (const std::runtime_error&) {
+				text.put(".half 0x");
+				text.hex(word & 0xffff, 4);
+				return text.finish();
+			}
+		}
+
+		uint8_t id = isa::decode(word);
+		if (!word)
+			text.put("(empty)");
+		else if (id == isa::invalid) {
+			text.put(".word 0x");
+			text.hex(word, 8);
+		}
+		else {
+			text.put(isa::table[id].name);
+			operand_printers()[id](*this, text, word, pc);
+		}
+		if (compressed)
+			text.put(text.commented ? ", rvc" : "  # rvc");
+		return text.finish();
+	}
+
+	std::string operator()(uint32_t word, uint32_t pc = no_pc) const {
+		char line[256];
+		return std::string(line, format(word, pc, line, sizeof(line)));
+	}
+
+private:
+	// Bounded appender, drops what does not fit.
+	struct writer {
+		char* at;
+		char* end;
+		char* start = at;
+		bool commented = false;
+
+		void put(char c) { if (at < end) *at++ = c; }
+		void put(const char* s) { while (*s && at < end) *at++ = *s++; }
+		void put(const std::string& s) { put(s.c_str()); }
+		void number(int32_t value) { at = std::to_chars(at, end, value).ptr; }
+		void hex(uint32_t value, int digits) {
+			static const char digit[] = "0123456789abcdef";
+			for (int i = digits - 1; i >= 0; i--) put(digit[(value >> (i * 4)) & 0xf]);
+		}
+		size_t finish() { *at = 0; return size_t(at - start); }
+	};
+
+	using operand_printer = void (*)(const disassembler& self, writer& text, uint32_t instruction, uint32_t pc);
+
+	template <size_t... Row>
+	static constexpr std::array<operand_printer, 256> make_printers(std::index_sequence<Row...>) {
+		std::array<operand_printer, 256> table{};
+		((table[Row] = &operands<isa::mnemonic(Row)>), ...);
+		return table;
+	}
+
+	static const operand_printer* operand_printers() {
+		static constexpr auto table = make_printers(std::make_index_sequence<isa::count>());
+		return table.data();
+	}
+
+	// Operand order follows what the assembler accepts for each format.
+	template <isa::mnemonic M>
+	static void operands(const disassembler& self, writer& text, uint32_t instruction, uint32_t pc) {
+		constexpr isa::format F = isa::info(M).type;
+		constexpr uint8_t op = isa::info(M).opcode;
+		uint32_t rd = isa::rd(instruction), rs1 = isa::rs1(instruction), rs2 = isa::rs2(instruction);
+		int32_t imm = isa::immediate<F>(instruction);
+		auto reg = [&](uint32_t r) { text.put(self.abi_names ? abi[r] : numbered[r]); };
+		auto sep = [&] { text.put(", "); };
+
+		text.put(' ');
+		if constexpr (F == isa::format::r) {
+			reg(rd); sep(); reg(rs1); sep(); reg(rs2);
+		}
+		else if constexpr (op == isa::itype_mem) {
+			reg(rd); sep(); text.number(imm); text.put('('); reg(rs1); text.put(')');
+		}
+		else if constexpr (F == isa::format::i || F == isa::format::shift) {
+			reg(rd); sep(); reg(rs1); sep(); text.number(imm);
+		}
+		else if constexpr (F == isa::format::s) {
+			reg(rs2); sep(); text.number(imm); text.put('('); reg(rs1); text.put(')');
+		}
+		else if constexpr (F == isa::format::b) {
+			reg(rs1); sep(); reg(rs2); sep(); text.number(imm);
+			self.target(text, pc, imm);
+		}
+		else if constexpr (F == isa::format::u) {
+			reg(rd); sep(); text.put("0x"); text.hex(uint32_t(imm) >> 12, 5);
+		}
+		else if constexpr (F == isa::format::j) {
+			reg(rd); sep(); text.number(imm);
+			self.target(text, pc, imm);
+		}
+		else if constexpr (M == isa::mnemonic::lr_w) {
+			reg(rd); sep(); text.put('('); reg(rs1); text.put(')');
+		}
+		else if constexpr (F == isa::format::amo) {
+			reg(rd); sep(); reg(rs2); sep(); text.put('('); reg(rs1); text.put(')');
+		}
+		else
+			text.at--; // fence takes no operands, take the space back
+	}
+
+	// "  # 0x40 <loop>" when the pc, and with it the target, is known.
+	void target(writer& text, uint32_t pc, int32_t offset) const {
+		if (pc == no_pc) return;
+		uint32_t address = pc + uint32_t(offset);
+		text.put("  # 0x");
+		text.hex(address, 8);
+		if (symbols)
+			if (auto label = symbols->at(address)) {
+				text.put(" <");
+				text.put(*label);
+				text.put('>');
+			}
+		text.commented = true;
+	}
+
+	static constexpr const char* numbered[32] = {
+		"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15",
+		"x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x29", "x30", "x31" };
+	static constexpr const char* abi[32] = {
+		"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+		"a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6" };
+};
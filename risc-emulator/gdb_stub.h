@@ -0,0 +1,484 @@
+#pragma once
+#include <cstdint>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "cpu_risc32i.h"
+#include "breakpoints.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+// GDB remote serial protocol server for a single cpu_risc32i, listening on localhost.
+//
+// Registers are exposed as riscv:rv32 (x0-x31, then pc). Addresses below
+// data_window read and write the byte addressed program image; data memory is
+// word indexed by loads and stores, so it is mapped word by word at
+// data_window + 4 * index. Software and hardware breakpoints are both kept in
+// a pc_bitmap and checked after every instruction while continuing; write
+// watchpoints (Z2) go through the cpu's page-flagged store check. Breakpoint
+// conditions are evaluated by gdb itself.
+class gdb_stub {
+public:
+	static constexpr uint32_t data_window = 0x80000000;
+
+	gdb_stub(cpu_risc32i& cpu) : cpu(cpu) {}
+
+	~gdb_stub() {
+		close_socket(client);
+		close_socket(server);
+#ifdef _WIN32
+		if (wsa_started) WSACleanup();
+#endif
+	}
+
+	// Blocks until a debugger attaches to localhost:port, then serves it until
+	// it detaches or kills the target. Returns false if the port can't be opened.
+	bool serve(uint16_t port) {
+		if (!listen_on(port))
+			return false;
+		printf("Waiting for gdb on localhost:%u (target remote :%u)\n", port, port);
+
+		client = accept(server, nullptr, nullptr);
+		if (client == invalid_socket)
+			return false;
+		int yes = 1;
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+
+		cpu.watchpoints = &watchpoints;
+
+		std::string packet;
+		while (read_packet(packet)) {
+			if (packet == "\x03") {
+				send_packet("S02");
+				continue;
+			}
+			if (packet[0] == 'D' || packet[0] == 'k' || packet == "vKill") {
+				if (packet[0] != 'k') send_packet("OK");
+				break;
+			}
+			send_packet(handle(packet));
+			if (packet == "QStartNoAckMode")
+				no_ack = true;
+		}
+		close_socket(client);
+		cpu.watchpoints = nullptr;
+		return true;
+	}
+
+	pc_bitmap breakpoints;
+	watchpoint_set watchpoints;
+
+private:
+#ifdef _WIN32
+	using socket_t = SOCKET;
+#else
+	using socket_t = int;
+#endif
+	static constexpr socket_t invalid_socket = socket_t(~0);
+
+	std::string handle(const std::string& packet) {
+		const char* args = packet.c_str() + 1;
+		std::string reply;
+		switch (packet[0]) {
+		case '?':
+			return "S05";
+		case 'g': {
+			for (uint32_t i = 0; i < 33; i++)
+				reply += to_hex_le(read_register(i));
+			return reply;
+		}
+		case 'G':
+			for (uint32_t i = 0; i < 33 && (i + 1) * 8 <= packet.size() - 1; i++)
+				write_register(i, from_hex_le(args + i * 8));
+			return "OK";
+		case 'p': {
+			uint32_t reg;
+			const char* end = nullptr;
+			if (!parse_hex(args, reg, end) || *end || reg > 32) return "E01";
+			return to_hex_le(read_register(reg));
+		}
+		case 'P': {
+			uint32_t reg;
+			const char* value = nullptr;
+			if (!parse_hex(args, reg, value) || *value != '=' || reg > 32 || strlen(value + 1) != 8 || !is_hex(value + 1, 8))
+				return "E01";
+			write_register(reg, from_hex_le(value + 1));
+			return "OK";
+		}
+		case 'm': {
+			uint32_t address, length;
+			const char* end = nullptr;
+			if (!parse_range(args, address, length, end) || *end) return "E01";
+			for (uint32_t i = 0; i < length; i++) {
+				uint8_t byte;
+				if (!read_byte(address + i, byte))
+					return i ? reply : "E01";
+				reply += hex_digits[byte >> 4];
+				reply += hex_digits[byte & 0xf];
+			}
+			return reply;
+		}
+		case 'M': {
+			uint32_t address, length;
+			const char* end = nullptr;
+			if (!parse_range(args, address, length, end) || *end != ':') return "E01";
+			const char* data = end + 1;
+			if (strlen(data) != size_t(length) * 2) return "E01";
+			for (uint32_t i = 0; i < length; i++)
+				if (!write_byte(address + i, uint8_t(from_hex(data + i * 2, 2))))
+					return "E01";
+			return "OK";
+		}
+		case 's':
+			if (*args && !set_pc(args)) return "E01";
+			cpu.stopRequested = false;
+			if (!step(reply)) return reply;
+			return stop_reply();
+		case 'c':
+			if (*args && !set_pc(args)) return "E01";
+			return resume();
+		case 'b':
+			if (!cpu.timeTravel) return "E01";
+			if (packet == "bs")
+				return cpu.reverse_step(1) ? "S05" : "T05replaylog:begin;";
+			if (packet == "bc")
+				return cpu.reverse_continue([this] { return breakpoints.test(cpu.get_pc()); }) ? "S05" : "T05replaylog:begin;";
+			return "";
+		case 'Z':
+		case 'z': {
+			// "Z<type>,<address>,<kind>", optionally followed by ";conditions"
+			uint32_t address, length;
+			const char* end = nullptr;
+			if (packet.size() < 3 || packet[2] != ',' || !parse_range(args + 2, address, length, end) || (*end && *end != ';'))
+				return "E01";
+			if (packet[1] == '0' || packet[1] == '1') {
+				// Z0 software and Z1 hardware breakpoints are the same thing here
+				if (packet[0] == 'Z') breakpoints.insert(address);
+				else breakpoints.erase(address);
+				return "OK";
+			}
+			if (packet[1] == '2') {
+				// write watchpoints only make sense on data memory
+				if (address < data_window) return "E01";
+				uint32_t first = (address - data_window) >> 2;
+				uint32_t words = ((address - data_window + length + 3) >> 2) - first;
+				if (packet[0] == 'Z') watchpoints.insert(first, words);
+				else watchpoints.erase(first, words);
+				return "OK";
+			}
+			return "";
+		}
+		case 'H':
+		case 'T':
+			return "OK";
+		case 'Q':
+			return packet == "QStartNoAckMode" ? "OK" : "";
+		case 'q':
+			return handle_query(packet);
+		}
+		return "";
+	}
+
+	std::string handle_query(const std::string& packet) {
+		if (packet.starts_with("qSupported"))
+			return std::string("PacketSize=4000;qXfer:features:read+;QStartNoAckMode+") + (cpu.timeTravel ? ";ReverseStep+;ReverseContinue+" : "");
+		if (packet == "qAttached") return "1";
+		if (packet == "qC") return "QC1";
+		if (packet == "qfThreadInfo") return "m1";
+		if (packet == "qsThreadInfo") return "l";
+		if (packet == "qOffsets") return "Text=0;Data=0;Bss=0";
+		if (packet.starts_with("qXfer:features:read:target.xml:")) {
+			std::string xml = target_description();
+			const char* range = packet.c_str() + strlen("qXfer:features:read:target.xml:");
+			uint32_t offset, length;
+			const char* end = nullptr;
+			if (!parse_range(range, offset, length, end) || *end) return "E01";
+			if (offset >= xml.size()) return "l";
+			std::string chunk = xml.substr(offset, length);
+			return (offset + length >= xml.size() ? "l" : "m") + chunk;
+		}
+		return "";
+	}
+
+	// Runs until a breakpoint or watchpoint, the cpu stalls on an empty
+	// instruction (reported as the program exiting) or gdb sends ^C.
+	std::string resume() {
+		cpu.stopRequested = false;
+		std::string reply;
+		for (;;) {
+			for (uint32_t n = 0; n < 65536; n++) {
+				if (!step(reply)) return reply;
+				if (cpu.stopRequested || breakpoints.test(cpu.get_pc())) return stop_reply();
+			}
+			if (interrupt_pending()) return "S02";
+		}
+	}
+
+	// One instruction. False with the stop reply when the program exited
+	// (W00) or the instruction threw (S04, SIGILL), pc is then left on it.
+	bool step(std::string& reply) {
+		try {
+			if (cpu.step()) return true;
+			reply = "W00";
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "ERROR: %s at pc %08x\n", e.what(), cpu.get_pc());
+			reply = "S04";
+		}
+		return false;
+	}
+
+	std::string stop_reply() {
+		if (!cpu.stopRequested)
+			return "S05";
+		char reply[32];
+		snprintf(reply, sizeof(reply), "T05watch:%x;", data_window + 4 * watchpoints.hit_address);
+		return reply;
+	}
+
+	static std::string target_description() {
+		static const char* names[] = {
+			"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "fp", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+			"a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6" };
+		std::string xml = "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\"><target version=\"1.0\">"
+			"<architecture>riscv:rv32</architecture><feature name=\"org.gnu.gdb.riscv.cpu\">";
+		for (uint32_t i = 0; i < 32; i++)
+			xml += std::string("<reg name=\"") + names[i] + "\" bitsize=\"32\" type=\"" + (i == 1 ? "code_ptr" : i == 2 ? "data_ptr" : "int") + "\"/>";
+		xml += "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/></feature></target>";
+		return xml;
+	}
+
+	uint32_t read_register(uint32_t reg) const {
+		return reg == 32 ? cpu.get_pc() : uint32_t(cpu.registers.REG[reg]);
+	}
+
+	void write_register(uint32_t reg, uint32_t value) {
+		if (reg == 32) cpu.set_pc(value);
+		else if (reg) cpu.registers.REG[reg] = int32_t(value);
+		edited();
+	}
+
+	std::vector<uint32_t>* memory_for(uint32_t& address) {
+		if (address >= data_window) {
+			address -= data_window;
+			return &cpu.data_memory();
+		}
+		return &cpu.program_memory();
+	}
+
+	bool read_byte(uint32_t address, uint8_t& value) {
+		auto& memory = *memory_for(address);
+		if ((address >> 2) >= memory.size()) return false;
+		value = uint8_t(memory[address >> 2] >> (8 * (address & 3)));
+		return true;
+	}
+
+	bool write_byte(uint32_t address, uint8_t value) {
+		auto& memory = *memory_for(address);
+		if ((address >> 2) >= memory.size()) return false;
+		uint32_t shift = 8 * (address & 3);
+		memory[address >> 2] = (memory[address >> 2] & ~(0xffu << shift)) | (uint32_t(value) << shift);
+		edited();
+		return true;
+	}
+
+	// Reverse execution can't go back past a debugger write, the recorded
+	// history would undo or replay around it.
+	void edited() {
+		if (cpu.timeTravel)
+			cpu.timeTravel->rebase(cpu.get_pc(), cpu.cycleCount, cpu.registers.REG);
+	}
+
+	// ---- packet layer ----
+
+	bool listen_on(uint16_t port) {
+#ifdef _WIN32
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa)) return false;
+		wsa_started = true;
+#endif
+		server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (server == invalid_socket) return false;
+		int yes = 1;
+		setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+
+		sockaddr_in address{};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(server, (sockaddr*)&address, sizeof(address)) || listen(server, 1)) {
+			fprintf(stderr, "ERROR: Could not listen on localhost:%u\n", port);
+			return false;
+		}
+		return true;
+	}
+
+	int read_char() {
+		if (buffer_pos == buffer_end) {
+			int received = recv(client, buffer, sizeof(buffer), 0);
+			if (received <= 0) return -1;
+			buffer_pos = 0;
+			buffer_end = received;
+		}
+		return (unsigned char)buffer[buffer_pos++];
+	}
+
+	// Reads the next packet body, or "\x03" for an out of band interrupt.
+	bool read_packet(std::string& packet) {
+		for (;;) {
+			int c = read_char();
+			if (c < 0) return false;
+			if (c == 0x03) {
+				packet = "\x03";
+				return true;
+			}
+			if (c != '$') continue; // acks and noise
+
+			packet.clear();
+			uint8_t checksum = 0;
+			while ((c = read_char()) >= 0 && c != '#') {
+				packet += char(c);
+				checksum += uint8_t(c);
+			}
+			char digits[2];
+			for (char& d : digits) {
+				if ((c = read_char()) < 0) return false;
+				d = char(c);
+			}
+			if (no_ack) return true;
+			bool valid = from_hex(digits, 2) == checksum;
+			send_raw(valid ? "+" : "-");
+			if (valid) return true;
+		}
+	}
+
+	void send_packet(const std::string& payload) {
+		uint8_t checksum = 0;
+		for (char c : payload) checksum += uint8_t(c);
+		std::string frame = "$" + payload + "#" + hex_digits[checksum >> 4] + hex_digits[checksum & 0xf];
+		for (;;) {
+			send_raw(frame);
+			if (no_ack) return;
+			int c = read_char();
+			if (c == '-') continue;
+			if (c >= 0 && c != '+') buffer_pos--; // start of the next packet, not an ack
+			return;
+		}
+	}
+
+	void send_raw(const std::string& data) {
+		send(client, data.c_str(), int(data.size()), 0);
+	}
+
+	// Only consumes the byte when it is the interrupt, anything else is the
+	// start of the next packet.
+	bool interrupt_pending() {
+		if (buffer_pos < buffer_end) {
+			if (buffer[buffer_pos] != 0x03) return false;
+			buffer_pos++;
+			return true;
+		}
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(client, &readable);
+		timeval timeout{};
+		if (select(int(client + 1), &readable, nullptr, nullptr, &timeout) <= 0)
+			return false;
+		int c = read_char();
+		if (c >= 0 && c != 0x03) buffer_pos--;
+		return c == 0x03;
+	}
+
+	// "<hex>,<hex>" as in m, M, Z and qXfer, `end` is left just past it.
+	// "<hex>", up to the first character that isn't a hex digit.
+	static bool parse_hex(const char* text, uint32_t& value, const char*& end) {
+		char* next = nullptr;
+		value = strtoul(text, &next, 16);
+		end = next;
+		return next != text && isxdigit((unsigned char)*text);
+	}
+
+	static bool is_hex(const char* text, size_t digits) {
+		for (size_t i = 0; i < digits; i++)
+			if (!isxdigit((unsigned char)text[i])) return false;
+		return true;
+	}
+
+	// s and c resume at "<address>" when one is given.
+	bool set_pc(const char* text) {
+		uint32_t address;
+		const char* end = nullptr;
+		if (!parse_hex(text, address, end) || *end) return false;
+		write_register(32, address);
+		return true;
+	}
+
+	static bool parse_range(const char* text, uint32_t& first, uint32_t& second, const char*& end) {
+		return parse_hex(text, first, end) && *end == ',' && parse_hex(end + 1, second, end);
+	}
+
+	static void close_socket(socket_t& s) {
+		if (s == invalid_socket) return;
+#ifdef _WIN32
+		closesocket(s);
+#else
+		close(s);
+#endif
+		s = invalid_socket;
+	}
+
+	static uint32_t from_hex(const char* text, int digits) {
+		uint32_t value = 0;
+		for (int i = 0; i < digits; i++) {
+			char c = text[i];
+			value = (value << 4) | uint32_t(c >= 'a' ? c - 'a' + 10 : c >= 'A' ? c - 'A' + 10 : c - '0');
+		}
+		return value;
+	}
+
+	// Register values travel as target (little endian) byte order.
+	static std::string to_hex_le(uint32_t value) {
+		std::string text;
+		for (int i = 0; i < 4; i++, value >>= 8) {
+			text += hex_digits[(value >> 4) & 0xf];
+			text += hex_digits[value & 0xf];
+		}
+		return text;
+	}
+
+	static uint32_t from_hex_le(const char* text) {
+		uint32_t value = 0;
+		for (int i = 0; i < 4; i++)
+			value |= from_hex(text + i * 2, 2) << (8 * i);
+		return value;
+	}
+
+	static constexpr const char* hex_digits = "0123456789abcdef";
+
+	cpu_risc32i& cpu;
+	socket_t server = invalid_socket;
+	socket_t client = invalid_socket;
+	char buffer[4096];
+	int buffer_pos = 0;
+	int buffer_end = 0;
+	bool no_ack = false;
+#ifdef _WIN32
+	bool wsa_started = false;
+#endif
+};
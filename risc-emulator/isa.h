@@ -0,0 +1,242 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <string_view>
+
+// The one description of the instruction encodings. The emulator's decode
+// table and execute handlers, the assembler's encoders, the coverage maps and
+// the benchmark corpus are all generated from `table` below, so adding an
+// instruction or fixing a field layout happens here and nowhere else.
+namespace isa {
+
+enum opcode : uint8_t {
+	lui = 0b0110111,
+	aupic = 0b0010111,
+	jal = 0b1101111,
+	jalr = 0b1100111,
+	btype = 0b1100011,
+	stype = 0b0100011,
+	itype_mem = 0b0000011,
+	itype = 0b0010011,
+	rtype = 0b0110011,
+	amo = 0b0101111,
+	fence = 0b0001111
+};
+
+// The letter is what reports print.
+enum class format : char { r = 'R', i = 'I', s = 'S', b = 'B', u = 'U', j = 'J', shift = 'H', amo = 'A', fence = 'F' };
+
+// In table order, so a mnemonic is also its row.
+enum class mnemonic : uint8_t {
+	lui, auipc, jal, jalr,
+	beq, bne, blt, bge, bltu, bgeu,
+	lb, lh, lw, lbu, lhu,
+	sb, sh, sw,
+	addi, slti, sltiu, xori, ori, andi, slli, srli, srai,
+	add, sub, sll, slt, sltu, xor_, srl, sra, or_, and_,
+	fence, fence_i,
+	lr_w, sc_w, amoswap_w, amoadd_w, amoxor_w, amoand_w, amoor_w, amomin_w, amomax_w, amominu_w, amomaxu_w,
+};
+
+struct instruction {
+	mnemonic id;
+	const char* name;
+	uint8_t opcode;
+	uint8_t funct3;
+	uint8_t funct7;
+	uint8_t funct7_mask;	// funct7 bits that select the instruction, 0 when funct7 is immediate bits
+	format type;
+	bool compressed = false;	// some RV32C parcel expands to it
+};
+
+inline constexpr instruction table[] = {
+	{ mnemonic::lui, "lui", lui, 0, 0, 0, format::u, true },
+	{ mnemonic::auipc, "auipc", aupic, 0, 0, 0, format::u },
+	{ mnemonic::jal, "jal", jal, 0, 0, 0, format::j, true },
+	{ mnemonic::jalr, "jalr", jalr, 0b000, 0, 0, format::i, true },
+	{ mnemonic::beq, "beq", btype, 0b000, 0, 0, format::b, true },
+	{ mnemonic::bne, "bne", btype, 0b001, 0, 0, format::b, true },
+	{ mnemonic::blt, "blt", btype, 0b100, 0, 0, format::b },
+	{ mnemonic::bge, "bge", btype, 0b101, 0, 0, format::b },
+	{ mnemonic::bltu, "bltu", btype, 0b110, 0, 0, format::b },
+	{ mnemonic::bgeu, "bgeu", btype, 0b111, 0, 0, format::b },
+	{ mnemonic::lb, "lb", itype_mem, 0b000, 0, 0, format::i },
+	{ mnemonic::lh, "lh", itype_mem, 0b001, 0, 0, format::i },
+	{ mnemonic::lw, "lw", itype_mem, 0b010, 0, 0, format::i, true },
+	{ mnemonic::lbu, "lbu", itype_mem, 0b100, 0, 0, format::i },
+	{ mnemonic::lhu, "lhu", itype_mem, 0b101, 0, 0, format::i },
+	{ mnemonic::sb, "sb", stype, 0b000, 0, 0, format::s },
+	{ mnemonic::sh, "sh", stype, 0b001, 0, 0, format::s },
+	{ mnemonic::sw, "sw", stype, 0b010, 0, 0, format::s, true },
+	{ mnemonic::addi, "addi", itype, 0b000, 0, 0, format::i, true },
+	{ mnemonic::slti, "slti", itype, 0b010, 0, 0, format::i },
+	{ mnemonic::sltiu, "sltiu", itype, 0b011, 0, 0, format::i },
+	{ mnemonic::xori, "xori", itype, 0b100, 0, 0, format::i },
+	{ mnemonic::ori, "ori", itype, 0b110, 0, 0, format::i },
+	{ mnemonic::andi, "andi", itype, 0b111, 0, 0, format::i, true },
+	{ mnemonic::slli, "slli", itype, 0b001, 0b0000000, 0x7f, format::shift, true },
+	{ mnemonic::srli, "srli", itype, 0b101, 0b0000000, 0x7f, format::shift, true },
+	{ mnemonic::srai, "srai", itype, 0b101, 0b0100000, 0x7f, format::shift, true },
+	{ mnemonic::add, "add", rtype, 0b000, 0b0000000, 0x7f, format::r, true },
+	{ mnemonic::sub, "sub", rtype, 0b000, 0b0100000, 0x7f, format::r, true },
+	{ mnemonic::sll, "sll", rtype, 0b001, 0b0000000, 0x7f, format::r },
+	{ mnemonic::slt, "slt", rtype, 0b010, 0b0000000, 0x7f, format::r },
+	{ mnemonic::sltu, "sltu", rtype, 0b011, 0b0000000, 0x7f, format::r },
+	{ mnemonic::xor_, "xor", rtype, 0b100, 0b0000000, 0x7f, format::r, true },
+	{ mnemonic::srl, "srl", rtype, 0b101, 0b0000000, 0x7f, format::r },
+	{ mnemonic::sra, "sra", rtype, 0b101, 0b0100000, 0x7f, format::r },
+	{ mnemonic::or_, "or", rtype, 0b110, 0b0000000, 0x7f, format::r, true },
+	{ mnemonic::and_, "and", rtype, 0b111, 0b0000000, 0x7f, format::r, true },
+	{ mnemonic::fence, "fence", fence, 0b000, 0, 0, format::fence },
+	{ mnemonic::fence_i, "fence.i", fence, 0b001, 0, 0, format::fence },
+	// RV32A, funct7 is funct5 plus the aq/rl bits
+	{ mnemonic::lr_w, "lr.w", amo, 0b010, 0b00010 << 2, 0x7c, format::amo },
+	{ mnemonic::sc_w, "sc.w", amo, 0b010, 0b00011 << 2, 0x7c, format::amo },
+	{ mnemonic::amoswap_w, "amoswap.w", amo, 0b010, 0b00001 << 2, 0x7c, format::amo },
+	{ mnemonic::amoadd_w, "amoadd.w", amo, 0b010, 0b00000 << 2, 0x7c, format::amo },
+	{ mnemonic::amoxor_w, "amoxor.w", amo, 0b010, 0b00100 << 2, 0x7c, format::amo },
+	{ mnemonic::amoand_w, "amoand.w", amo, 0b010, 0b01100 << 2, 0x7c, format::amo },
+	{ mnemonic::amoor_w, "amoor.w", amo, 0b010, 0b01000 << 2, 0x7c, format::amo },
+	{ mnemonic::amomin_w, "amomin.w", amo, 0b010, 0b10000 << 2, 0x7c, format::amo },
+	{ mnemonic::amomax_w, "amomax.w", amo, 0b010, 0b10100 << 2, 0x7c, format::amo },
+	{ mnemonic::amominu_w, "amominu.w", amo, 0b010, 0b11000 << 2, 0x7c, format::amo },
+	{ mnemonic::amomaxu_w, "amomaxu.w", amo, 0b010, 0b11100 << 2, 0x7c, format::amo },
+};
+inline constexpr size_t count = std::size(table);
+
+constexpr bool table_in_mnemonic_order() {
+	for (size_t i = 0; i < count; i++)
+		if (size_t(table[i].id) != i) return false;
+	return true;
+}
+static_assert(table_in_mnemonic_order(), "isa::table rows must follow isa::mnemonic");
+
+constexpr const instruction& info(mnemonic id) { return table[size_t(id)]; }
+
+// Null for names that are not in the table.
+constexpr const instruction* find(std::string_view name) {
+	for (auto& row : table)
+		if (name == row.name) return &row;
+	return nullptr;
+}
+
+constexpr uint32_t rd(uint32_t instruction) { return (instruction >> 7) & 31; }
+constexpr uint32_t rs1(uint32_t instruction) { return (instruction >> 15) & 31; }
+constexpr uint32_t rs2(uint32_t instruction) { return (instruction >> 20) & 31; }
+constexpr uint32_t funct3(uint32_t instruction) { return (instruction >> 12) & 7; }
+constexpr uint32_t funct7(uint32_t instruction) { return instruction >> 25; }
+
+// Sign-extended immediate of a format. The sign comes from an arithmetic
+// shift of bit 31 and the scattered fields are masked in, so there are no
+// branches.
+template <format F>
+constexpr int32_t immediate(uint32_t instruction) {
+	if constexpr (F == format::i)
+		return int32_t(instruction) >> 20;
+	else if constexpr (F == format::shift)
+		return int32_t((instruction >> 20) & 31);
+	else if constexpr (F == format::s)
+		return ((int32_t(instruction) >> 20) & ~0x1f) | int32_t((instruction >> 7) & 0x1f);
+	else if constexpr (F == format::b)	// imm[12|10:5] rs2 rs1 funct3 imm[4:1|11]
+		return (int32_t(instruction & 0x80000000) >> 19) | int32_t(((instruction << 4) & 0x800) | ((instruction >> 20) & 0x7e0) | ((instruction >> 7) & 0x1e));
+	else if constexpr (F == format::u)
+		return int32_t(instruction & 0xfffff000);
+	else if constexpr (F == format::j)	// imm[20|10:1|11|19:12] rd
+		return (int32_t(instruction & 0x80000000) >> 11) | int32_t((instruction & 0xff000) | ((instruction >> 9) & 0x800) | ((instruction >> 20) & 0x7fe));
+	else
+		return 0;
+}
+
+// The immediate bits of a format placed in an otherwise empty word. U-type
+// takes the value that ends up in the register, low 12 bits ignored.
+template <format F>
+constexpr uint32_t place_immediate(int32_t imm) {
+	uint32_t v = uint32_t(imm);
+	if constexpr (F == format::i)
+		return (v & 0xfff) << 20;
+	else if constexpr (F == format::shift)
+		return (v & 31) << 20;
+	else if constexpr (F == format::s)
+		return ((v >> 5) & 0x7f) << 25 | (v & 0x1f) << 7;
+	else if constexpr (F == format::b)
+		return ((v >> 12) & 1) << 31 | ((v >> 5) & 0x3f) << 25 | ((v >> 1) & 0xf) << 8 | ((v >> 11) & 1) << 7;
+	else if constexpr (F == format::u)
+		return v & 0xfffff000;
+	else if constexpr (F == format::j)
+		return ((v >> 20) & 1) << 31 | ((v >> 1) & 0x3ff) << 21 | ((v >> 11) & 1) << 20 | (v & 0xff000);
+	else
+		return 0;
+}
+
+// Replaces the immediate of an encoded instruction, for relocations.
+template <format F>
+constexpr uint32_t with_immediate(uint32_t instruction, int32_t imm) {
+	return (instruction & ~place_immediate<F>(-1)) | place_immediate<F>(imm);
+}
+
+// Fields a format has no room for are dropped.
+template <format F>
+constexpr uint32_t encode(const instruction& row, uint32_t rd, uint32_t rs1, uint32_t rs2, int32_t imm) {
+	uint32_t word = row.opcode | uint32_t(row.funct3) << 12 | uint32_t(row.funct7) << 25;
+	if constexpr (F == format::u || F == format::j)
+		word &= 0x7f;
+	if constexpr (F != format::s && F != format::b && F != format::fence)
+		word |= (rd & 31) << 7;
+	if constexpr (F != format::u && F != format::j && F != format::fence)
+		word |= (rs1 & 31) << 15;
+	if constexpr (F == format::r || F == format::s || F == format::b || F == format::amo)
+		word |= (rs2 & 31) << 20;
+	return word | place_immediate<F>(imm);
+}
+
+// Runtime format dispatch over encode<F>().
+constexpr uint32_t encode(const instruction& row, uint32_t rd, uint32_t rs1, uint32_t rs2, int32_t imm) {
+	switch (row.type) {
+	case format::r: return encode<format::r>(row, rd, rs1, rs2, imm);
+	case format::i: return encode<format::i>(row, rd, rs1, rs2, imm);
+	case format::s: return encode<format::s>(row, rd, rs1, rs2, imm);
+	case format::b: return encode<format::b>(row, rd, rs1, rs2, imm);
+	case format::u: return encode<format::u>(row, rd, rs1, rs2, imm);
+	case format::j: return encode<format::j>(row, rd, rs1, rs2, imm);
+	case format::shift: return encode<format::shift>(row, rd, rs1, rs2, imm);
+	case format::amo: return encode<format::amo>(row, rd, rs1, rs2, imm);
+	case format::fence: return encode<format::fence>(row, rd, rs1, rs2, imm);
+	}
+	return 0;
+}
+
+constexpr uint32_t encode(mnemonic id, uint32_t rd, uint32_t rs1, uint32_t rs2, int32_t imm) {
+	return encode(info(id), rd, rs1, rs2, imm);
+}
+
+// opcode[6:2], funct3, funct7 of a 32-bit instruction, whose opcode[1:0] is always 11.
+constexpr uint32_t decode_key(uint32_t instruction) {
+	return ((instruction & 0x7c) << 8) | ((instruction >> 5) & 0x380) | (instruction >> 25);
+}
+
+inline constexpr uint8_t invalid = 0xff;
+
+// Table row for every decode key, `invalid` where nothing matches. 32KB, so
+// decode is one load instead of a chain of opcode and funct compares.
+inline constexpr std::array<uint8_t, 1 << 15> decode_table = [] {
+	std::array<uint8_t, 1 << 15> keys{};
+	for (auto& key : keys) key = invalid;
+	for (size_t i = 0; i < count; i++) {
+		auto& row = table[i];
+		bool any_funct3 = row.type == format::u || row.type == format::j;
+		for (uint32_t f3 = 0; f3 < 8; f3++) {
+			if (!any_funct3 && f3 != row.funct3) continue;
+			for (uint32_t f7 = 0; f7 < 128; f7++)
+				if ((f7 & row.funct7_mask) == row.funct7)
+					keys[decode_key(row.opcode | (f3 << 12) | (f7 << 25))] = uint8_t(i);
+		}
+	}
+	return keys;
+}();
+
+// Table row of an instruction, or `invalid`.
+constexpr uint8_t decode(uint32_t instruction) {
+	return (instruction & 0b11) == 0b11 ? decode_table[decode_key(instruction)] : invalid;
+}
+
+}
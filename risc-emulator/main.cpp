@@ -2,383 +2,189 @@
 #include <vector>
 #include <string>
 #include <fstream>
-#include <format>
 #include <thread>
+#include <map>
+#include <sstream>
+#include "cpu_risc32i.h"
+#include "arguments.h"
+#include "breakpoints.h"
+#include "gdb_stub.h"
+#include "smp.h"
+#include "coverage.h"
+#include "disassembler.h"
+#include "trace_writer.h"
+#include "telemetry.h"
+
+// Interactive stepping console, forwards and backwards through time.
+void run_debug_console(cpu_risc32i& rv) {
+	breakpoint_set breakpoints;
+	watchpoint_set watchpoints;
+	condition stop_condition;	// checked after every instruction while set
+	std::string line;
+
+	rv.watchpoints = &watchpoints;
+
+	auto stopped = [&] {
+		if (breakpoints.should_stop(rv.get_pc(), rv.registers.REG, rv.data_memory())) return "breakpoint";
+		if (!stop_condition.empty() && stop_condition.evaluate(rv.registers.REG, rv.get_pc(), rv.data_memory())) return "condition";
+		return "";
+	};
 
-class cpu_risc32i {
-
-public:
-
-	cpu_risc32i() : cpu_risc32i(4096) {}
-
-	cpu_risc32i(uint32_t memory_size) {
-		memory.resize(memory_size);
-		reset();
-	}
-
-	void reset(uint32_t reset_pc = 0) {
-		this->pc = reset_pc;
-		for (int i = 0; i < 32; i++)
-			registers.REG[0] = 0;
-		registers.alias.sp = 1024;// memory.size() - 4;
-		// clear memory
-		for (auto& i : memory) i = 0;
-		isolated_memory = memory;
-	}
-
-	void load_program(uint32_t offset, const std::vector<uint32_t>& bin) {
-		for (uint32_t i = 0; i < std::min(bin.size(), memory.size()); i++)
-			memory[i + offset] = bin.at(i); // throws exception if out of bounds
-		isolated_memory = memory;
-	}
-
-	uint32_t cycle() {
-		cycleCount++;
-
-		// 1) Read instruction at PC
-		int32_t pc = this->pc;
-		uint32_t instruction = memory[pc >> 2];
-
-		if (!instruction) {
-			display_registers();
-			return instruction;
+	auto run = [&](uint64_t limit) {
+		rv.stopRequested = false;
+		for (uint64_t n = 0; n < limit; n++) {
+			if (!rv.step()) return "halted";
+			if (rv.stopRequested) return "watchpoint";
+			if (const char* reason = stopped(); *reason) return reason;
 		}
+		return "";
+	};
 
-		// 2) Decode instruction
-		uint32_t opcode = instruction & 0b00000000000000000000000001111111;
-		uint32_t rd = instruction & 0b00000000000000000000111110000000;
-		uint32_t funct3 = instruction & 0b00000000000000000111000000000000;
-		uint32_t rs1 = instruction & 0b00000000000011111000000000000000;
-		uint32_t rs2 = instruction & 0b00000001111100000000000000000000;
-		uint32_t imm_lower_btype = instruction & 0b00000000000000000000111110000000; // Note: s and b types use the same bits
-		uint32_t imm_upper_btype = instruction & 0b11111110000000000000000000000000;
-		uint32_t imm_utype = instruction & 0b11111111111111111111000000000000;
-		uint32_t imm_jtype = instruction & 0b11111111111111111111000000000000;
-		uint32_t imm_itype = instruction & 0b11111111111100000000000000000000;
-		uint32_t funct7 = instruction & 0b11111110000000000000000000000000;
-
-		rd >>= 7;
-		rs1 >>= 15;
-		rs2 >>= 20;
-		funct3 >>= 12;
-
-		registers.alias.zero = 0;
-
-		// 3) Execute instruction
-		if (opcode == opcode::lui) {
-			registers.REG[rd] = imm_utype;
-			this->pc = pc + 4;
-		}
-		else if (opcode == opcode::aupic) {
-			registers.REG[rd] = imm_utype + pc;
-			this->pc = pc + 4;
-		}
-		else if (opcode == opcode::jal) {
-			// rd <- pc + 4
-			// pc <- pc + imm_j
-			int32_t imm_j = (imm_itype & 0x80000000) ? 0b1111111111100000000000000000000 : 0; // this is the sign extension
-			imm_j |= imm_jtype & 0b00000000000011111111000000000000;
-			imm_j |= (imm_jtype >> 19) & 0b00000000000000000000011111111110;
-			registers.REG[rd] = pc + 4;
-			this->pc = (pc + imm_j) & ~1;
-		}
-		else if (opcode == opcode::jalr) {
-			// rd <- pc + 4
-			// pc <- (rs1 + imm_i) & ~1
-			int32_t imm_i = (imm_itype & 0x80000000) ? 0xfffff000 : 0; // this is the sign extension
-			imm_i |= imm_itype >> 20;
-			this->pc = (registers.REG[rs1] + imm_i) & ~1;
-			registers.REG[rd] = pc + 4;
-		}
-		else if (opcode == opcode::btype) {
-			// pc <- pc + ( rs1 == rs2) ? imm_b : 4 )
-			int32_t imm_b = (imm_upper_btype & 0x80000000) ? 0xfffff000 : 0; // this is the sign extension
-			imm_b |= (imm_upper_btype >> 25) << 5;
-			imm_b |= imm_lower_btype >> 7;
-			imm_b &= ~((1 << 11) | (1 << 12)); // clear the 12th and 11th bit
-			imm_b |= (imm_lower_btype << 4) & (1 << 11); // set 11th bit
-			imm_b |= (imm_upper_btype & 0x80000000) ? (1 << 12) : 0; // set 12th bit
-			imm_b &= ~1;
-			switch (funct3) {
-			case 0b000 /* beq  */: this->pc = pc + (int32_t(registers.REG[rs1]) == int32_t(registers.REG[rs2]) ? imm_b : 4); break;
-			case 0b001 /* bne  */: this->pc = pc + (int32_t(registers.REG[rs1]) != int32_t(registers.REG[rs2]) ? imm_b : 4); break;
-			case 0b100 /* blt  */: this->pc = pc + (int32_t(registers.REG[rs1]) < int32_t(registers.REG[rs2]) ? imm_b : 4); break;
-			case 0b101 /* bge  */: this->pc = pc + (int32_t(registers.REG[rs1]) >= int32_t(registers.REG[rs2]) ? imm_b : 4); break;
-			case 0b110 /* bltu */: this->pc = pc + (uint32_t(registers.REG[rs1]) < uint32_t(registers.REG[rs2]) ? imm_b : 4); break;
-			case 0b111 /* bgeu */: this->pc = pc + (uint32_t(registers.REG[rs1]) >= uint32_t(registers.REG[rs2]) ? imm_b : 4); break;
-			default:
-				throw std::runtime_error("Invalid funct3 for branching.");
+	printf("\033[?25h");
+	printf("commands: s [n], rs [n], c, rc, b <pc> [if <expr>], d <pc>, w <addr> [words], dw <addr> [words], cond [expr], r, q\n");
+	while (printf("(rv) "), std::getline(std::cin, line)) {
+		std::istringstream iss(line);
+		std::string command, operand, count;
+		iss >> command >> operand;
+		const char* reason = "";
+
+		try {
+			if (command == "s") reason = run(operand.empty() ? 1 : std::stoull(operand));
+			else if (command == "c") reason = run(UINT64_MAX);
+			else if (command == "rs") {
+				uint64_t count = operand.empty() ? 1 : std::stoull(operand);
+				if (rv.reverse_step(count) < count) reason = "start of recorded history";
 			}
-		}
-		else if (opcode == opcode::itype_mem) {
-			int32_t imm_i = (imm_itype & 0x80000000) ? 0xfffff000 : 0; // this is the sign extension
-			imm_i |= imm_itype >> 20;
-			uint32_t read_address = registers.REG[rs1] + imm_i;
-			uint32_t data = isolated_memory[read_address % isolated_memory.size()];
-			switch (funct3) {
-			case 0b000 /* lb  */: registers.REG[rd] = int32_t(int8_t(data)); break;
-			case 0b001 /* lh  */: registers.REG[rd] = int32_t(int16_t(data)); break;
-			case 0b010 /* lw  */: registers.REG[rd] = int32_t(data); break;
-			case 0b100 /* lbu */: registers.REG[rd] = uint32_t(uint8_t(data)); break;
-			case 0b101 /* lhu */: registers.REG[rd] = uint32_t(uint16_t(data)); break;
-			default:
-				throw std::runtime_error("Invalid funct3 for memory load (lb, lh, lw, lbu, lhu are only valid)");
+			else if (command == "rc") {
+				// anything found that is not a breakpoint or the condition was a watchpoint
+				bool found = rv.reverse_continue([&] { return *stopped() != 0; });
+				reason = !found ? "start of recorded history" : *stopped() ? stopped() : "watchpoint";
 			}
-			this->pc = pc + 4;
-		}
-		else if (opcode == opcode::itype) {
-			int32_t imm_i = (imm_itype & 0x80000000) ? 0xfffff000 : 0; // this is the sign extension
-			imm_i |= imm_itype >> 20;
-			switch (funct3) {
-			case 0b000 /* addi */:
-				// rd <- rs1 + imm_i, pc <- pc+4
-				registers.REG[rd] = registers.REG[rs1] + imm_i;
-				this->pc = pc + 4;
-				break;
-			case 0b010 /* slti */:
-				// rd <- (rs1 < imm_i) ? 1 : 0, pc <- pc+4
-				registers.REG[rd] = int32_t(registers.REG[rs1]) < int32_t(imm_i);
-				this->pc = pc + 4;
-				break;
-			case 0b011 /* sltiu */:
-				// rd <- (rs1 < imm_i) ? 1: 0, pc <- pc+4
-				registers.REG[rd] = uint32_t(registers.REG[rs1]) < uint32_t(imm_i);
-				this->pc = pc + 4;
-				break;
-			case 0b100 /* xori */:
-				// rd <- (rs1 ^ imm_i) ? 1: 0, pc <- pc+4
-				registers.REG[rd] = registers.REG[rs1] ^ imm_i;
-				this->pc = pc + 4;
-				break;
-			case 0b110 /* ori */:
-				// rd <- (rs1 ^ imm_i) ? 1: 0, pc <- pc+4
-				registers.REG[rd] = registers.REG[rs1] | imm_i;
-				this->pc = pc + 4;
-				break; break;
-			case 0b111 /* andi */:
-				// rd <- (rs1 ^ imm_i) ? 1: 0, pc <- pc+4
-				registers.REG[rd] = registers.REG[rs1] & imm_i;
-				this->pc = pc + 4;
-				break; break;
-			case 0b001 /* slli */:
-				registers.REG[rd] = registers.REG[rs1] << imm_i;
-				this->pc = pc + 4;
-				break; break;
-			case 0b101 /* srli and srai */:
-				if (funct7) {
-					// srai
-					registers.REG[rd] = int32_t(registers.REG[rs1]) >> imm_i;
-				}
-				else {
-					// srli
-					registers.REG[rd] = uint32_t(registers.REG[rs1]) >> imm_i;
-				}
-				this->pc = pc + 4;
-				break;
+			else if (command == "b" && !operand.empty()) {
+				std::string keyword, expression;
+				iss >> keyword;
+				std::getline(iss, expression);
+				if (!keyword.empty() && keyword != "if") throw std::runtime_error("Expected 'if' after breakpoint address");
+				breakpoints.insert(std::stoul(operand, nullptr, 16), condition(keyword.empty() ? "" : expression));
+				continue;
 			}
-		}
-		else if (opcode == opcode::stype) {
-			int32_t imm_s = (imm_upper_btype & 0x80000000) ? 0xfffff000 : 0; // sign extension
-			imm_s |= imm_upper_btype >> 20;
-			imm_s |= imm_lower_btype >> 7;
-			// so easy :) compared to b-type
-			uint32_t memory_address = (imm_s + registers.REG[rs1]) % isolated_memory.size();
-			uint32_t old_data = isolated_memory[memory_address];
-			switch (funct3) {
-			case 0b000 /* sb */:
-				old_data &= 0xffffff00; // clear out bottom byte
-				isolated_memory[memory_address] = old_data | (registers.REG[rs2] & 0x000000ff /* select bottom 8-bits*/);
-				this->pc = pc + 4;
-				break;
-			case 0b001 /* sh */:
-				old_data &= 0xffff0000; // clear out bottom 2-byte
-				isolated_memory[memory_address] = old_data | (registers.REG[rs2] & 0x0000ffff /* select bottom 16-bits*/);
-				this->pc = pc + 4;
-				break;
-			case 0b010 /* sw */:
-				isolated_memory[memory_address] = registers.REG[rs2];
-				this->pc = pc + 4;
-				break;
+			else if (command == "d" && !operand.empty()) { breakpoints.erase(std::stoul(operand, nullptr, 16)); continue; }
+			else if (command == "w" && !operand.empty()) {
+				iss >> count;
+				watchpoints.insert(std::stoul(operand, nullptr, 16), count.empty() ? 1 : std::stoul(count));
+				continue;
 			}
-		}
-		else if (opcode == opcode::rtype) {
-			switch (funct3) {
-			case 0b000 /* add/sub */:
-				registers.REG[rd] = funct7 ? registers.REG[rs1] - registers.REG[rs2] : registers.REG[rs1] + registers.REG[rs2];
-				this->pc = pc + 4;
-				break;
-			case 0b001 /* sll */:
-				registers.REG[rd] = registers.REG[rs1] << registers.REG[rs2];
-				this->pc = pc + 4;
-				break;
-			case 0b010 /* slt */:
-				registers.REG[rd] = int32_t(registers.REG[rs1]) < int32_t(registers.REG[rs2]) ? 1 : 0;
-				this->pc = pc + 4;
-				break;
-			case 0b011 /* sltu */:
-				registers.REG[rd] = uint32_t(registers.REG[rs1]) < uint32_t(registers.REG[rs2]) ? 1 : 0;
-				this->pc = pc + 4;
-				break;
-			case 0b100 /* xori */:
-				// rd <- (rs1 ^ imm_i) ? 1: 0, pc <- pc+4
-				registers.REG[rd] = registers.REG[rs1] ^ registers.REG[rs2];
-				this->pc = pc + 4;
-				break;
-			case 0b101 /* srl or sra */:
-				if (!funct7)
-					registers.REG[rd] = uint32_t(registers.REG[rs1]) >> registers.REG[rs2];
-				else
-					registers.REG[rd] = int32_t(registers.REG[rs1]) >> registers.REG[rs2];
-				this->pc = pc + 4;
-				break;
-			case 0b110 /* or */:
-				registers.REG[rd] = registers.REG[rs1] | registers.REG[rs2];
-				this->pc = pc + 4;
-				break;
-			case 0b111 /* and */:
-				registers.REG[rd] = registers.REG[rs1] & registers.REG[rs2];
-				this->pc = pc + 4;
-				break;
-			default:
-				throw std::runtime_error("Invalid r-type funct3.");
+			else if (command == "dw" && !operand.empty()) {
+				iss >> count;
+				if (!watchpoints.erase(std::stoul(operand, nullptr, 16), count.empty() ? 1 : std::stoul(count)))
+					printf("no watchpoint at %s\n", operand.c_str());
+				continue;
+			}
+			else if (command == "cond") {
+				size_t at = line.find("cond") + 4;
+				stop_condition = operand.empty() ? condition() : condition(line.substr(at));
+				continue;
 			}
+			else if (command == "q") break;
+			else if (command != "r") { printf("unknown command '%s'\n", line.c_str()); continue; }
 		}
-		else {
-			throw std::runtime_error("Invalid instruction type encountered.");
+		catch (const std::exception& e) {
+			printf("%s\n", e.what());
+			continue;
 		}
 
-		registers.alias.zero = 0;
-
-		// 5) Present register state
-		display_registers();
-		return instruction;
+		rv.display_registers();
+		if (!strcmp(reason, "watchpoint"))
+			printf("stopped: watchpoint, store to mem[0x%X] at pc 0x%08X\n", watchpoints.hit_address, watchpoints.hit_pc);
+		else if (*reason) printf("stopped: %s\n", reason);
 	}
 
-	static int countDigits(int32_t number) {
-		int digits = (number < 0); // Add 1 for the negative sign if the number is negative
-		for (number = number < 0 ? -number : number; number; number /= 10) digits++;
-		return digits ? digits : 1; // Ensure 0 returns 1 digit
+	rv.watchpoints = nullptr;
+}
+
+int main(int argc, char** argv) {
+
+	auto args = ProccessArguments(argc, argv, {
+		std::make_pair("-i", ArgOpt{std::string("mem.init.txt")}),
+		std::make_pair("-bp", ArgOpt{std::string("none")}),			// none, static, bimodal, gshare
+		std::make_pair("-bp-bits", ArgOpt{std::string("12")}),		// log2 of the counter table size
+		std::make_pair("-bp-ras", ArgOpt{std::string("16")}),		// return-address stack depth
+		std::make_pair("-bp-penalty", ArgOpt{std::string("2")}),	// cycles lost per misprediction
+		std::make_pair("-debug", ArgOpt{std::string("0")}),			// 1 = interactive console with reverse execution
+		std::make_pair("-tt-interval", ArgOpt{std::string("1000000")}),	// instructions between history checkpoints
+		std::make_pair("-gdb", ArgOpt{std::string("0")}),			// port for a gdb remote serial protocol server
+		std::make_pair("-fps", ArgOpt{std::string("30")}),			// register display refresh cap, 0 = every cycle
+		std::make_pair("-harts", ArgOpt{std::string("1")}),			// harts sharing memory, each on its own host thread
+		std::make_pair("-smp", ArgOpt{std::string("threads")}),		// threads, or rr for deterministic round robin
+		std::make_pair("-smp-quantum", ArgOpt{std::string("1")}),	// instructions per hart per round robin turn
+		std::make_pair("-smp-limit", ArgOpt{std::string("100000000")}),	// instructions per hart before giving up
+		std::make_pair("-memory-order", ArgOpt{std::string("acqrel")}),	// relaxed, acqrel, sc
+		std::make_pair("-coverage", ArgOpt{}),						// coverage file, merged into when it exists
+		std::make_pair("-coverage-report", ArgOpt{}),				// comma separated coverage files to merge and report
+		std::make_pair("-trace-disasm", ArgOpt{std::string("0")}),	// 1 = disassembly column in emulator.log
+		std::make_pair("-trace-buffer", ArgOpt{std::string("65536")}),	// records between the cpu and the log writer thread
+		std::make_pair("-trace-backpressure", ArgOpt{std::string("block")}),	// block, or drop records when the writer falls behind
+		std::make_pair("-trace-compress", ArgOpt{std::string("0")}),	// 1 = gzip the log into emulator.log.gz
+		std::make_pair("-stats", ArgOpt{}),							// JSON progress file, rewritten while the run goes (not with -gdb or -debug)
+		std::make_pair("-stats-interval", ArgOpt{std::string("1000")}),	// milliseconds between rewrites
+		std::make_pair("-map", ArgOpt{}),							// label map from the assembler's -map, names targets in that column
+	});
+
+	if (!args["-coverage-report"].empty()) {
+		try {
+			instruction_coverage total;
+			std::stringstream files(args["-coverage-report"]);
+			for (std::string file; std::getline(files, file, ',');)
+				if (!file.empty()) total.load(file);
+			total.report(stdout);
+			if (!args["-coverage"].empty())
+				total.save(args["-coverage"]);
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "ERROR: %s\n", e.what());
+			return 1;
+		}
+		return 0;
 	}
 
-	void display_registers() const {
-		//return;
-		int maxDigits = 0;
-		for (int i = 0; i < 32; i++)
-			maxDigits = std::max(countDigits((int32_t)registers.REG[i]), maxDigits);
-
-		printf("\033[H");
-		system("cls");
+	printf("\033[2J\033[H");
 
-		printf("pc   = %0*d / 0x%08X     |     Cycle Count = %d\n", maxDigits, pc, pc, cycleCount);
-		printf("zero = "); if (old_registers.REG[0] != registers.REG[0]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[0], registers.REG[0]); printf("\033[0m");
-		printf("ra   = "); if (old_registers.REG[1] != registers.REG[1]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[1], registers.REG[1]); printf("\033[0m");
-		printf("sp   = "); if (old_registers.REG[2] != registers.REG[2]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[2], registers.REG[2]); printf("\033[0m");
-		printf("gp   = "); if (old_registers.REG[3] != registers.REG[3]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[3], registers.REG[3]); printf("\033[0m");
-		printf("tp   = "); if (old_registers.REG[4] != registers.REG[4]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[4], registers.REG[4]); printf("\033[0m");
-		printf("t0   = "); if (old_registers.REG[5] != registers.REG[5]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[5], registers.REG[5]); printf("\033[0m");
-		printf("t1   = "); if (old_registers.REG[6] != registers.REG[6]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[6], registers.REG[6]); printf("\033[0m");
-		printf("t2   = "); if (old_registers.REG[7] != registers.REG[7]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[7], registers.REG[7]); printf("\033[0m");
-		printf("s0   = "); if (old_registers.REG[8] != registers.REG[8]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[8], registers.REG[8]); printf("\033[0m");
-		printf("s1   = "); if (old_registers.REG[9] != registers.REG[9]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[9], registers.REG[9]); printf("\033[0m");
-		printf("a0   = "); if (old_registers.REG[10] != registers.REG[10]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[10], registers.REG[10]); printf("\033[0m");
-		printf("a1   = "); if (old_registers.REG[11] != registers.REG[11]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[11], registers.REG[11]); printf("\033[0m");
-		printf("a2   = "); if (old_registers.REG[12] != registers.REG[12]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[12], registers.REG[12]); printf("\033[0m");
-		printf("a3   = "); if (old_registers.REG[13] != registers.REG[13]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[13], registers.REG[13]); printf("\033[0m");
-		printf("a4   = "); if (old_registers.REG[14] != registers.REG[14]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[14], registers.REG[14]); printf("\033[0m");
-		printf("a5   = "); if (old_registers.REG[15] != registers.REG[15]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[15], registers.REG[15]); printf("\033[0m");
-		printf("a6   = "); if (old_registers.REG[16] != registers.REG[16]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[16], registers.REG[16]); printf("\033[0m");
-		printf("a7   = "); if (old_registers.REG[17] != registers.REG[17]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[17], registers.REG[17]); printf("\033[0m");
-		printf("s2   = "); if (old_registers.REG[18] != registers.REG[18]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[18], registers.REG[18]); printf("\033[0m");
-		printf("s3   = "); if (old_registers.REG[19] != registers.REG[19]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[19], registers.REG[19]); printf("\033[0m");
-		printf("s4   = "); if (old_registers.REG[20] != registers.REG[20]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[20], registers.REG[20]); printf("\033[0m");
-		printf("s5   = "); if (old_registers.REG[21] != registers.REG[21]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[21], registers.REG[21]); printf("\033[0m");
-		printf("s6   = "); if (old_registers.REG[22] != registers.REG[22]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[22], registers.REG[22]); printf("\033[0m");
-		printf("s7   = "); if (old_registers.REG[23] != registers.REG[23]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[23], registers.REG[23]); printf("\033[0m");
-		printf("s8   = "); if (old_registers.REG[24] != registers.REG[24]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[24], registers.REG[24]); printf("\033[0m");
-		printf("s9   = "); if (old_registers.REG[25] != registers.REG[25]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[25], registers.REG[25]); printf("\033[0m");
-		printf("s10  = "); if (old_registers.REG[26] != registers.REG[26]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[26], registers.REG[26]); printf("\033[0m");
-		printf("s11  = "); if (old_registers.REG[27] != registers.REG[27]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[27], registers.REG[27]); printf("\033[0m");
-		printf("t3   = "); if (old_registers.REG[28] != registers.REG[28]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[28], registers.REG[28]); printf("\033[0m");
-		printf("t4   = "); if (old_registers.REG[29] != registers.REG[29]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[29], registers.REG[29]); printf("\033[0m");
-		printf("t5   = "); if (old_registers.REG[30] != registers.REG[30]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[30], registers.REG[30]); printf("\033[0m");
-		printf("t6   = "); if (old_registers.REG[31] != registers.REG[31]) printf("\033[31m"); printf("%0*d / 0x%08X\n", maxDigits, registers.REG[31], registers.REG[31]); printf("\033[0m");
+	cpu_risc32i rv(262144);
+	rv.display.set_max_fps(std::stoul(args["-fps"]));
 
-		memcpy((void*)&old_registers, (void*)&registers, sizeof(register_file));
+	std::unique_ptr<branch_model> branchModel;
+	if (args["-bp"] != "none") {
+		try {
+			branchModel = branch_model::create(args["-bp"], std::stoul(args["-bp-bits"]), std::stoul(args["-bp-ras"]), std::stoul(args["-bp-penalty"]));
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "ERROR: %s\n", e.what());
+			return 1;
+		}
+		rv.branchModel = branchModel.get();
 	}
 
-
-public:
-	enum opcode : uint8_t {
-		lui = 0b0110111,
-		aupic = 0b0010111,
-		jal = 0b1101111,
-		jalr = 0b1100111,
-		btype = 0b1100011,
-		stype = 0b0100011,
-		itype_mem = 0b0000011,
-		itype = 0b0010011,
-		rtype = 0b0110011
-	};
-
-	struct register_file {
-		union {
-			int32_t REG[32];
-			struct {
-				/* x0  */ int32_t zero;
-				/* x1  */ int32_t ra;  // return address	(Saved by caller)
-				/* x2  */ int32_t sp;  // stack pointer	(Saved by callee)
-				/* x3  */ int32_t gp;  // global pointer
-				/* x4  */ int32_t tp;  // thread pointer
-				/* x5  */ int32_t t0;  // temporary / alternate return address (Saved by caller)
-				/* x6  */ int32_t t1;  // temporary (Saved by caller)
-				/* x7  */ int32_t t2;  // temporary (Saved by caller)
-				/* x8  */ int32_t s0;  // Saved register / frame pointer (Saved by caller)
-				/* x9  */ int32_t s1;  // Saved register (Saved by caller)
-				/* x10 */ int32_t a0;  // Function argument / return value (Caller)
-				/* x11 */ int32_t a1;  // Function argument / return value (Caller)
-				/* x12 */ int32_t a2;  // Function argument
-				/* x13 */ int32_t a3;  // Function argument
-				/* x14 */ int32_t a4;  // Function argument
-				/* x15 */ int32_t a5;  // Function argument
-				/* x16 */ int32_t a6;  // Function argument
-				/* x17 */ int32_t a7;  // Function argument
-				/* x18 */ int32_t s2;  // Saved register
-				/* x19 */ int32_t s3;  // Saved register
-				/* x20 */ int32_t s4;  // Saved register
-				/* x21 */ int32_t s5;  // Saved register
-				/* x22 */ int32_t s6;  // Saved register
-				/* x23 */ int32_t s7;  // Saved register
-				/* x24 */ int32_t s8;  // Saved register
-				/* x25 */ int32_t s9;  // Saved register
-				/* x26 */ int32_t s10; // Saved register
-				/* x27 */ int32_t s11; // Saved register
-				/* x28 */ int32_t t3;  // Temporary
-				/* x29 */ int32_t t4;  // Temporary
-				/* x30 */ int32_t t5;  // Temporary
-				/* x31 */ int32_t t6;  // Temporary
-			} alias;
-		};
+	// Each hart records into its own map, they are merged when the run ends
+	std::vector<instruction_coverage> coverage;
+	auto write_coverage = [&] {
+		if (coverage.empty()) return;
+		for (size_t i = 1; i < coverage.size(); i++)
+			coverage[0].merge(coverage[i]);
+		try {
+			coverage[0].accumulate(args["-coverage"]);
+			coverage[0].summary(stdout);
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "ERROR: %s\n", e.what());
+		}
 	};
-public:
-	register_file registers;
-	int cycleCount = 0;
-
-protected:
-	std::vector<uint32_t> memory;
-	std::vector<uint32_t> isolated_memory;
-	uint32_t pc; // program counter
-	register_file old_registers;
-
-};
-
-int main() {
-	
-	system("cls");
-
-	cpu_risc32i rv(262144);
 
 	std::vector<uint32_t> program_c;
-	std::fstream bin("C:\\Users\\youssef\\Downloads\\mem.init.txt");
+	std::fstream bin(args["-i"]);
+	if (!bin) {
+		fprintf(stderr, "ERROR: Cannot open program image '%s'\n", args["-i"].c_str());
+		return 1;
+	}
 	std::string text;
 	while (std::getline(bin, text)) {
 		program_c.push_back(std::stoul(text, nullptr, 16));
@@ -388,8 +194,97 @@ int main() {
 	rv.load_program(0, program_c);
 	rv.display_registers();
 
-	std::ofstream cpu_state("emulator.log");
+	// Batch runs only, the interactive paths have their own front ends
+	std::unique_ptr<telemetry> stats;
+	if (!args["-stats"].empty() && args["-gdb"] == "0" && args["-debug"] == "0")
+		stats = std::make_unique<telemetry>(args["-stats"], std::stoul(args["-harts"]), std::stoul(args["-stats-interval"]), args["-i"]);
+
+	if (args["-harts"] != "1") {
+		if (args["-gdb"] != "0" || args["-debug"] != "0") {
+			fprintf(stderr, "ERROR: -gdb and -debug are single hart only\n");
+			return 1;
+		}
+		try {
+			smp_system smp(rv, std::stoul(args["-harts"]), smp_system::parse_ordering(args["-memory-order"]));
+			if (!args["-coverage"].empty()) {
+				coverage.resize(smp.size());
+				for (size_t i = 0; i < smp.size(); i++)
+					smp.hart(i).coverage = &coverage[i];
+			}
+			if (stats) {
+				smp.stats = stats.get();
+				for (size_t i = 0; i < smp.size(); i++)
+					stats->hart(i).limit.store(std::stoull(args["-smp-limit"]), std::memory_order_relaxed);
+			}
+			if (args["-smp"] == "rr") smp.run_round_robin(std::stoull(args["-smp-limit"]), std::stoul(args["-smp-quantum"]));
+			else if (args["-smp"] == "threads") smp.run_threads(std::stoull(args["-smp-limit"]));
+			else throw std::runtime_error("Unknown -smp mode '" + args["-smp"] + "' (threads, rr are valid)");
+			if (stats) {
+				// Harts still running are the ones that reached -smp-limit
+				for (size_t i = 0; i < smp.size(); i++)
+					if (stats->hart(i).status.load() == telemetry::state::running)
+						stats->hart(i).finish(smp.hart(i), telemetry::state::finished);
+				stats->stop();
+			}
+			smp.report(stdout);
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "ERROR: %s\n", e.what());
+			return 1;
+		}
+		if (branchModel)
+			branchModel->report(stdout, rv.fetchStats.instructions);
+		write_coverage();
+		return 0;
+	}
+
+	if (!args["-coverage"].empty()) {
+		coverage.resize(1);
+		rv.coverage = &coverage[0];
+	}
+
+	if (args["-gdb"] != "0") {
+		time_travel timeTravel(std::stoull(args["-tt-interval"]));
+		rv.timeTravel = &timeTravel;
+		gdb_stub stub(rv);
+		bool served = stub.serve(uint16_t(std::stoul(args["-gdb"])));
+		write_coverage();
+		return served ? 0 : 1;
+	}
+
+	if (args["-debug"] != "0") {
+		time_travel timeTravel(std::stoull(args["-tt-interval"]));
+		rv.timeTravel = &timeTravel;
+		run_debug_console(rv);
+		write_coverage();
+		return 0;
+	}
+
 	uint32_t instruction = 0;
+
+	// The disassembly sits between the instruction and the ':' so log-checker still reads the line
+	symbol_map symbols;
+	disassembler disassemble;
+	std::unique_ptr<trace_writer> cpu_state;
+	try {
+		if (!args["-map"].empty()) {
+			symbols.load(args["-map"]);
+			disassemble.symbols = &symbols;
+		}
+		bool compress = args["-trace-compress"] != "0";
+		cpu_state = std::make_unique<trace_writer>(compress ? "emulator.log.gz" : "emulator.log", rv.registers.REG,
+			std::stoul(args["-trace-buffer"]), trace_writer::parse_backpressure(args["-trace-backpressure"]), compress,
+			args["-trace-disasm"] != "0" ? &disassemble : nullptr);
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "ERROR: %s\n", e.what());
+		return 1;
+	}
+	if (stats) {
+		stats->watch_trace(&cpu_state->statistics());
+		stats->hart(0).limit.store(program_c.size(), std::memory_order_relaxed);
+		stats->hart(0).status.store(telemetry::state::running, std::memory_order_relaxed);
+	}
 #if 1
 	printf("\033[?25l");  // Hide cursor
 
@@ -439,51 +334,49 @@ int main() {
 
 	printf("\033[0mEmulator Running...\n");
 
-	char spinner[] = { '\\', '|', '/', '-' };
-	char spinner2[] = { 'o', '.', '0', 'O' };
-	int spinnerIdx = 0;
+	rv.display.progress_total = program_c.size();
+	rv.display.invalidate();
 #endif
-	for (int n = 0; n < program_c.size(); n++) {
-#if 1
-		instruction = rv.cycle();
-		if (n % 100 == 0) {
-			int percentDone = (100 * n) / program_c.size();
-
-			printf("%c ", spinner[(spinnerIdx) / 10]);
-
-			printf("<\033[44;32m");
-			for (int i = 0; i <= 400; i += 10) {
-				// Calculate color intensity based on i, increase brightness every 40 increments
-				int brightness = (i / 40);  // Ranges from 0 to 10
-
-				// Background color starts at dark yellow (130) and gets brighter
-				int bgColor = 130 + brightness;  // Dark yellow -> bright yellow
-
-				// Foreground color starts at yellow (226) and gradually becomes green (46)
-				int fgColor = 226 - brightness;  // Yellow -> Green
-
-				if (percentDone * 4 > i) {
-					printf("\033[48;5;%d;38;5;%dm", bgColor, fgColor);
-					printf("-");
-				}
-				else
-					printf("\033[0m");
-			}
-			printf("> %d%% done %c\r", percentDone, spinner[(spinnerIdx++) / 10]);
-			spinnerIdx = spinnerIdx == 4 * 10 ? 0 : spinnerIdx;
+	try {
+		for (int n = 0; n < program_c.size(); n++) {
+			uint32_t pc = rv.get_pc();
+			instruction = rv.cycle();
+			cpu_state->push(rv.cycleCount, pc, instruction, rv.registers.REG);
+			if (stats && !(n % telemetry::stride))
+				stats->hart(0).publish(rv);
+			//system("PAUSE > NUL");
 		}
-#endif
-
-		cpu_state << std::format("{:04d} ({:08X}):   ", rv.cycleCount, instruction);
-		for (int i = 0; i < 32; i++) {
-			cpu_state << std::format("{:x} ", (uint32_t)rv.registers.REG[i]);
+	}
+	catch (const std::exception& e) {
+		// The lines up to the faulting instruction are the ones log-checker needs
+		cpu_state->close();
+		if (stats) {
+			stats->hart(0).finish(rv, telemetry::state::failed);
+			stats->stop();
 		}
-		cpu_state << '\n';
-		cpu_state.flush();
 		rv.display_registers();
-		//system("PAUSE > NUL");
+		fprintf(stderr, "ERROR: %s\n", e.what());
+		return 1;
+	}
+	cpu_state->close();
+	if (stats) {
+		stats->hart(0).finish(rv, instruction ? telemetry::state::finished : telemetry::state::halted);
+		stats->stop();
+	}
+	rv.display_registers();
+
+	auto& fs = rv.fetchStats;
+	if (fs.instructions) {
+		uint64_t uncompressedBytes = fs.instructions * 4;
+		printf("\nFetch report: %llu instructions, %llu compressed (%.1f%%)\n", (unsigned long long)fs.instructions,
+			(unsigned long long)fs.compressed, 100.0 * fs.compressed / fs.instructions);
+		printf("              %llu bytes fetched vs %llu as RV32I (%.1f%% fetch bandwidth saved)\n", (unsigned long long)fs.bytes,
+			(unsigned long long)uncompressedBytes, 100.0 * (uncompressedBytes - fs.bytes) / uncompressedBytes);
 	}
-	cpu_state.close();
+	cpu_state->report(stdout);
+	if (branchModel)
+		branchModel->report(stdout, fs.instructions);
+	write_coverage();
 	/*
 	0x7ff00313, //addi x6 x0 2
 		0x00800393, //addi x7 x0 8
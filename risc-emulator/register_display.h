@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Terminal view of the pc and register file for the interactive modes.
+//
+// Each frame is formatted into one preallocated buffer and handed to the
+// terminal with a single write. Only lines whose value or highlight changed
+// since the last frame are redrawn, using absolute cursor addressing, so a
+// frame while a loop spins over a few registers is a couple of hundred bytes.
+// frame() is cheap to call every cycle: it only reads the clock every
+// clock_stride calls and draws at most max_fps times a second.
+class register_display {
+public:
+	static constexpr int rows = 34;			// header + 32 registers + progress
+	static constexpr uint32_t clock_stride = 64;
+
+	explicit register_display(uint32_t max_fps = 30) { set_max_fps(max_fps); }
+
+	// 0 draws on every call.
+	void set_max_fps(uint32_t max_fps) {
+		period = max_fps ? std::chrono::nanoseconds(1000000000ull / max_fps) : std::chrono::nanoseconds(0);
+	}
+
+	// Shown as a percentage when non-zero, against the cycle count.
+	uint64_t progress_total = 0;
+
+	// Rate limited, returns true when a frame was drawn.
+	bool frame(const int32_t* registers, uint32_t pc, uint64_t cycle) {
+		if (period.count()) {
+			if (++calls < clock_stride) return false;
+			calls = 0;
+			auto now = std::chrono::steady_clock::now();
+			if (now < next_frame) return false;
+			next_frame = now + period;
+		}
+		draw(registers, pc, cycle);
+		return true;
+	}
+
+	// Unconditional, leaves the cursor below the view so console output follows it.
+	void draw(const int32_t* registers, uint32_t pc, uint64_t cycle) {
+		fflush(stdout); // anything printf'd before must land before this frame
+		length = 0;
+		if (!drawn) append("\033[H\033[2J");
+
+		if (!drawn || pc != shown_pc || cycle != shown_cycle) {
+			move_to(1);
+			append("pc   = %011u / 0x%08X     |     Cycle Count = %llu\033[K", pc, pc, (unsigned long long)cycle);
+			shown_pc = pc;
+			shown_cycle = cycle;
+		}
+
+		static const char* names[32] = {
+			"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+			"a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6" };
+		for (int i = 0; i < 32; i++) {
+			bool changed = drawn && registers[i] != shown[i];
+			if (drawn && !changed && !highlighted[i]) continue;
+			move_to(2 + i);
+			append("%s%-4s = %011d / 0x%08X\033[0m\033[K", changed ? "\033[31m" : "", names[i], registers[i], uint32_t(registers[i]));
+			shown[i] = registers[i];
+			highlighted[i] = changed;
+		}
+
+		if (progress_total) {
+			uint64_t done = std::min(cycle, progress_total);
+			move_to(rows);
+			append("%llu / %llu cycles, %llu%% done\033[K", (unsigned long long)done, (unsigned long long)progress_total,
+				(unsigned long long)(100 * done / progress_total));
+		}
+
+		move_to(rows + 1);
+		append("\033[J");
+		drawn = true;
+		flush();
+	}
+
+	// The next frame repaints everything, e.g. after other output scrolled the screen.
+	void invalidate() { drawn = false; }
+
+private:
+	template <typename... Args>
+	void append(const char* format, Args... args) {
+		int written = snprintf(buffer + length, sizeof(buffer) - length, format, args...);
+		if (written > 0) length = std::min(sizeof(buffer) - 1, length + size_t(written));
+	}
+
+	void move_to(int row) { append("\033[%d;1H", row); }
+
+	void flush() {
+		const char* data = buffer;
+		size_t remaining = length;
+		while (remaining) {
+#ifdef _WIN32
+			int written = _write(1, data, unsigned(remaining));
+#else
+			ssize_t written = write(STDOUT_FILENO, data, remaining);
+#endif
+			if (written <= 0) break;
+			data += written;
+			remaining -= size_t(written);
+		}
+	}
+
+	// 34 full lines with escapes come to about 2.5KB
+	char buffer[4096];
+	size_t length = 0;
+
+	bool drawn = false;
+	int32_t shown[32] = {};
+	bool highlighted[32] = {};
+	uint32_t shown_pc = 0;
+	uint64_t shown_cycle = 0;
+
+	std::chrono::nanoseconds period;
+	std::chrono::steady_clock::time_point next_frame;
+	uint32_t calls = 0;
+};
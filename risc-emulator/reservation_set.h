@@ -0,0 +1,110 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// lr.w/sc.w reservations of harts sharing one data memory.
+//
+// Every store and AMO clears the other harts' reservations on the word it
+// wrote, so an sc.w fails after any intervening store from another hart, ABA
+// sequences included. Reservations are guarded by one of a few striped locks;
+// a store only takes its stripe's lock when a reservation is held there. The
+// store, a fence and the check of `held` pair with lr.w's increment, fence
+// and load, so either the lr.w sees the store or the store sees the
+// reservation. sc.w also compares the word with what lr.w read, which covers
+// a store that lands between lr.w taking the reservation and that store's
+// check; that is only ever a store of the same value, which nobody can tell
+// apart from one made before the lr.w.
+class reservation_set {
+public:
+	explicit reservation_set(uint32_t harts) : slots(harts) {}
+
+	// lr.w by `hart`, returns the word.
+	uint32_t reserve(uint32_t hart, std::atomic_ref<uint32_t> word, uint32_t index) {
+		release(hart);
+		auto& stripe = stripe_of(index);
+		std::lock_guard<std::mutex> lock(stripe.lock);
+		stripe.held.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		auto& slot = slots[hart];
+		uint32_t value = word.load(std::memory_order_seq_cst);
+		slot.index.store(index, std::memory_order_relaxed);
+		slot.value = value;
+		slot.valid.store(true, std::memory_order_release);
+		return value;
+	}
+
+	// sc.w by `hart`, the reservation is gone afterwards either way.
+	bool conditional_store(uint32_t hart, std::atomic_ref<uint32_t> word, uint32_t index, uint32_t value) {
+		auto& slot = slots[hart];
+		if (!slot.valid.load(std::memory_order_acquire) || slot.index.load(std::memory_order_relaxed) != index) {
+			release(hart);
+			return false;
+		}
+		auto& stripe = stripe_of(index);
+		std::lock_guard<std::mutex> lock(stripe.lock);
+		if (!slot.valid.load(std::memory_order_relaxed))
+			return false; // cleared by a store since the check above
+		slot.valid.store(false, std::memory_order_relaxed);
+		stripe.held.fetch_sub(1, std::memory_order_relaxed);
+		uint32_t expected = slot.value;
+		if (!word.compare_exchange_strong(expected, value))
+			return false;
+		clear(hart, index);
+		return true;
+	}
+
+	// After every store or AMO `hart` made to `index`.
+	void stored(uint32_t hart, uint32_t index) {
+		auto& stripe = stripe_of(index);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!stripe.held.load(std::memory_order_relaxed))
+			return;
+		std::lock_guard<std::mutex> lock(stripe.lock);
+		clear(hart, index);
+	}
+
+private:
+	static constexpr uint32_t stripe_count = 64;
+
+	struct alignas(64) stripe {
+		std::mutex lock;
+		std::atomic<uint32_t> held{ 0 };	// valid reservations on words of this stripe
+	};
+
+	// Owned by its hart, cleared by others under the stripe lock of `index`.
+	struct alignas(64) slot {
+		std::atomic<uint32_t> index{ 0 };
+		std::atomic<bool> valid{ false };
+		uint32_t value = 0;
+	};
+
+	stripe& stripe_of(uint32_t index) { return stripes[index % stripe_count]; }
+
+	void release(uint32_t hart) {
+		auto& slot = slots[hart];
+		if (!slot.valid.load(std::memory_order_acquire)) return;
+		auto& stripe = stripe_of(slot.index.load(std::memory_order_relaxed));
+		std::lock_guard<std::mutex> lock(stripe.lock);
+		if (slot.valid.load(std::memory_order_relaxed)) {
+			slot.valid.store(false, std::memory_order_relaxed);
+			stripe.held.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Caller holds the stripe lock of `index`.
+	void clear(uint32_t hart, uint32_t index) {
+		for (uint32_t other = 0; other < slots.size(); other++) {
+			auto& slot = slots[other];
+			if (other == hart || !slot.valid.load(std::memory_order_acquire) || slot.index.load(std::memory_order_relaxed) != index)
+				continue;
+			slot.valid.store(false, std::memory_order_relaxed);
+			stripe_of(index).held.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+
+	std::array<stripe, stripe_count> stripes;
+	std::vector<slot> slots;
+};
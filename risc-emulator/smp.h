@@ -0,0 +1,141 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <memory>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include "cpu_risc32i.h"
+#include "telemetry.h"
+
+// Several harts over one program and data memory. The boot hart is the
+// caller's cpu with the program already loaded. The others share its memory
+// and start at pc 0 with their hart id in tp, so guest code tells them apart
+// the usual way.
+//
+// run_threads() gives every hart its own host thread and is as parallel as
+// the host allows. The interleaving is then up to the host scheduler.
+// run_round_robin() steps the harts on the calling thread, `quantum`
+// instructions each in hart order, so a run and its traces are reproducible.
+class smp_system {
+public:
+	struct hart_status {
+		uint64_t retired = 0;
+		bool halted = false;	// fetched an empty instruction
+		std::string error;		// what the hart threw, if anything
+	};
+
+	smp_system(cpu_risc32i& boot, uint32_t hart_count, memory_ordering ordering) {
+		if (hart_count < 1)
+			throw std::runtime_error("At least one hart is needed");
+		if (hart_count > boot.program_memory().size())
+			throw std::runtime_error("More harts than words of memory to put their stacks in");
+		harts.push_back(&boot);
+		boot.share_memory(hart_count);
+		for (uint32_t id = 1; id < hart_count; id++) {
+			secondary.push_back(std::make_unique<cpu_risc32i>(boot, id, hart_count));
+			harts.push_back(secondary.back().get());
+		}
+		if (hart_count > 1)
+			reservations = std::make_unique<reservation_set>(hart_count);
+		for (auto hart : harts) {
+			hart->ordering = hart_count > 1 ? ordering : memory_ordering::single;
+			hart->reservations = reservations.get();
+		}
+		status.resize(hart_count);
+	}
+
+	// The boot hart outlives the system, its memory is its own again.
+	~smp_system() {
+		harts[0]->ordering = memory_ordering::single;
+		harts[0]->reservations = nullptr;
+	}
+
+	// Each hart runs until it halts, throws or retires `limit` instructions.
+	void run_threads(uint64_t limit) {
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < harts.size(); i++)
+			threads.emplace_back([this, i, limit] { run_hart(i, limit); });
+		for (auto& thread : threads)
+			thread.join();
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void run_round_robin(uint64_t limit, uint32_t quantum = 1) {
+		auto start = std::chrono::steady_clock::now();
+		for (bool running = true; running;) {
+			running = false;
+			for (size_t i = 0; i < harts.size(); i++) {
+				auto& hart = status[i];
+				if (hart.halted || !hart.error.empty() || hart.retired >= limit) continue;
+				run_hart(i, std::min<uint64_t>(limit, hart.retired + std::max(quantum, 1u)));
+				running = true;
+			}
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void report(FILE* out) const {
+		uint64_t retired = 0;
+		fprintf(out, "\n%-5s  %-10s  %12s  %-10s  %s\n", "hart", "pc", "retired", "a0", "status");
+		for (size_t i = 0; i < harts.size(); i++) {
+			auto& hart = status[i];
+			retired += hart.retired;
+			fprintf(out, "%-5zu  0x%08X  %12llu  0x%08X  %s\n", i, harts[i]->get_pc(), (unsigned long long)hart.retired,
+				uint32_t(harts[i]->registers.alias.a0), !hart.error.empty() ? hart.error.c_str() : hart.halted ? "halted" : "limit");
+		}
+		fprintf(out, "%llu instructions in %.3fs, %.2f MIPS\n", (unsigned long long)retired, seconds, seconds > 0 ? retired / seconds / 1e6 : 0.0);
+	}
+
+	cpu_risc32i& hart(size_t id) { return *harts[id]; }
+	const hart_status& hart_state(size_t id) const { return status[id]; }
+	size_t size() const { return harts.size(); }
+
+	// Live per-hart progress, published by each hart's own thread, if set.
+	telemetry* stats = nullptr;
+
+	static memory_ordering parse_ordering(const std::string& name) {
+		if (name == "relaxed") return memory_ordering::relaxed;
+		if (name == "acqrel") return memory_ordering::acquire_release;
+		if (name == "sc") return memory_ordering::sequential;
+		throw std::runtime_error("Unknown memory ordering '" + name + "' (relaxed, acqrel, sc are valid)");
+	}
+
+private:
+	// Only ever touched by the hart's own thread while running. The count is
+	// kept local so neighbouring harts don't fight over the status cache line.
+	void run_hart(size_t i, uint64_t limit) {
+		auto& cpu = *harts[i];
+		auto& hart = status[i];
+		uint64_t retired = hart.retired;
+		telemetry::instance* live = stats ? &stats->hart(i) : nullptr;
+		if (live && live->status.load(std::memory_order_relaxed) == telemetry::state::starting)
+			live->status.store(telemetry::state::running, std::memory_order_relaxed);
+		try {
+			while (retired < limit) {
+				if (!cpu.step()) {
+					hart.halted = true;
+					break;
+				}
+				retired++;
+				if (live && !(retired % telemetry::stride))
+					live->publish(cpu);
+			}
+		}
+		catch (const std::exception& e) {
+			hart.error = e.what();
+		}
+		hart.retired = retired;
+		if (live && (hart.halted || !hart.error.empty()))
+			live->finish(cpu, hart.halted ? telemetry::state::halted : telemetry::state::failed);
+	}
+
+	std::vector<cpu_risc32i*> harts;
+	std::vector<std::unique_ptr<cpu_risc32i>> secondary;
+	std::unique_ptr<reservation_set> reservations;
+	std::vector<hart_status> status;
+	double seconds = 0;
+};
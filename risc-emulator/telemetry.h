@@ -0,0 +1,169 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <stdexcept>
+#include "cpu_risc32i.h"
+#include "trace_writer.h"
+
+// Live progress for runs nobody is watching: a JSON stats file rewritten every
+// `interval` by a background thread, for batch schedulers and farms of
+// emulator processes to poll.
+//
+// Each hart has an instance that only its own thread writes, with relaxed
+// stores every `stride` instructions, so the hot loop never takes a lock or
+// waits on I/O. The sampler reads them with relaxed loads and works out the
+// rates itself. The file is written next to the target and renamed over it,
+// so a reader always sees a complete one.
+class telemetry {
+public:
+	static constexpr uint64_t stride = 256;	// instructions between publishes
+
+	enum class state : uint32_t { starting, running, halted, finished, failed };
+	static constexpr const char* state_names[] = { "starting", "running", "halted", "finished", "failed" };
+
+	struct alignas(64) instance {
+		std::atomic<uint64_t> retired{ 0 };
+		std::atomic<uint64_t> cycles{ 0 };
+		std::atomic<uint32_t> pc{ 0 };
+		std::atomic<state> status{ state::starting };
+		std::atomic<uint64_t> limit{ 0 };	// instructions the run is expected to take, 0 when unknown
+
+		// Hart's own thread only.
+		void publish(const cpu_risc32i& cpu) {
+			retired.store(cpu.fetchStats.instructions, std::memory_order_relaxed);
+			cycles.store(cpu.cycleCount, std::memory_order_relaxed);
+			pc.store(cpu.get_pc(), std::memory_order_relaxed);
+		}
+		void finish(const cpu_risc32i& cpu, state final) {
+			publish(cpu);
+			status.store(final, std::memory_order_relaxed);
+		}
+	};
+
+	telemetry(const std::string& path, size_t instances, uint32_t interval_ms, const std::string& input)
+		: path(path), input(input), interval(std::chrono::milliseconds(std::max(interval_ms, 10u))), count(instances),
+		  harts(std::make_unique<instance[]>(instances)), previous(std::make_unique<uint64_t[]>(instances)) {
+		write();
+		sampler = std::thread([this] { sample(); });
+	}
+
+	~telemetry() { stop(); }
+
+	telemetry(const telemetry&) = delete;
+	telemetry& operator=(const telemetry&) = delete;
+
+	instance& hart(size_t id) { return harts[id]; }
+	size_t size() const { return count; }
+
+	// Adds the trace writer's byte and drop counts, it has to outlive stop().
+	void watch_trace(const trace_writer::counters* counters) { trace.store(counters, std::memory_order_release); }
+
+	// Writes the final state and joins the sampler.
+	void stop() {
+		if (!sampler.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_one();
+		sampler.join();
+		write();
+	}
+
+private:
+	void sample() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!wake.wait_for(lock, interval, [this] { return stopping; }))
+			write();
+	}
+
+	void write() {
+		auto now = std::chrono::steady_clock::now();
+		double elapsed = std::chrono::duration<double>(now - started).count();
+		double window = std::chrono::duration<double>(now - sampled).count();
+		sampled = now;
+
+		std::string temporary = path + ".tmp";
+		FILE* out = fopen(temporary.c_str(), "w");
+		if (!out) {
+			if (!warned) fprintf(stderr, "WARNING: Cannot write stats file '%s'\n", temporary.c_str());
+			warned = true;
+			return;
+		}
+
+		uint64_t total = 0;
+		double mips = 0;
+		bool running = false, failed = false, halted = false;
+		std::string rows;
+		for (size_t i = 0; i < count; i++) {
+			auto& hart = harts[i];
+			uint64_t retired = hart.retired.load(std::memory_order_relaxed);
+			state status = hart.status.load(std::memory_order_relaxed);
+			double rate = window > 0 ? (retired - previous[i]) / window / 1e6 : 0.0;
+			previous[i] = retired;
+			total += retired;
+			mips += rate;
+			running |= status == state::starting || status == state::running;
+			failed |= status == state::failed;
+			halted |= status == state::halted;
+
+			char row[256];
+			snprintf(row, sizeof(row), "%s\n    { \"hart\": %zu, \"status\": \"%s\", \"pc\": \"0x%08X\", \"instructions\": %llu, \"cycles\": %llu, \"limit\": %llu, \"mips\": %.2f }",
+				i ? "," : "", i, state_names[uint32_t(status)], hart.pc.load(std::memory_order_relaxed), (unsigned long long)retired,
+				(unsigned long long)hart.cycles.load(std::memory_order_relaxed), (unsigned long long)hart.limit.load(std::memory_order_relaxed), rate);
+			rows += row;
+		}
+
+		state overall = running ? state::running : failed ? state::failed : halted ? state::halted : state::finished;
+		fprintf(out, "{\n  \"input\": \"%s\",\n  \"status\": \"%s\",\n  \"seconds\": %.3f,\n  \"instructions\": %llu,\n  \"mips\": %.2f,\n",
+			escaped(input).c_str(), state_names[uint32_t(overall)], elapsed, (unsigned long long)total, mips);
+		auto counters = trace.load(std::memory_order_acquire);
+		fprintf(out, "  \"average_mips\": %.2f,\n  \"trace_bytes\": %llu,\n  \"trace_dropped\": %llu,\n  \"harts\": [%s\n  ]\n}\n",
+			elapsed > 0 ? total / elapsed / 1e6 : 0.0,
+			(unsigned long long)(counters ? counters->bytes.load(std::memory_order_relaxed) : 0),
+			(unsigned long long)(counters ? counters->dropped.load(std::memory_order_relaxed) : 0), rows.c_str());
+		bool written = fclose(out) == 0;
+
+		std::error_code error;
+		if (written)
+			std::filesystem::rename(temporary, path, error);
+		if ((!written || error) && !warned) {
+			fprintf(stderr, "WARNING: Cannot replace stats file '%s'\n", path.c_str());
+			warned = true;
+		}
+	}
+
+	static std::string escaped(const std::string& text) {
+		std::string result;
+		for (char c : text) {
+			if (c == '"' || c == '\\') result.push_back('\\');
+			result.push_back(c);
+		}
+		return result;
+	}
+
+	std::string path;
+	std::string input;
+	std::chrono::milliseconds interval;
+	size_t count;
+	std::unique_ptr<instance[]> harts;
+	std::unique_ptr<uint64_t[]> previous;	// retired at the last sample, for the current rate
+	std::atomic<const trace_writer::counters*> trace{ nullptr };
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point sampled = started;
+	bool warned = false;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+	std::thread sampler;
+};
@@ -0,0 +1,142 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+
+// History recorder for reverse execution.
+//
+// Every retired instruction appends an undo record (old rd value, old store
+// word) to a log that only spans the current checkpoint interval. Every
+// `interval` instructions a checkpoint captures the register file and pc, and
+// from then on the first store into each data memory page saves that page's
+// pre-image into the checkpoint. Going back to checkpoint K therefore means
+// applying the pre-images of every checkpoint from the newest down to K, and
+// anything in between two checkpoints is reached by replaying forward.
+class time_travel {
+public:
+	static constexpr uint32_t page_shift = 10; // 1024 words (4KB) per page
+	static constexpr uint32_t page_words = 1u << page_shift;
+
+	struct undo_record {
+		uint32_t pc;
+		uint64_t cycle;
+		int32_t old_rd;
+		uint32_t old_word;
+		uint32_t store_address;	// word index, or no_store
+		uint8_t rd;
+	};
+	static constexpr uint32_t no_store = 0xffffffff;
+
+	struct checkpoint {
+		uint64_t position;		// instructions retired when taken
+		uint32_t pc;
+		uint64_t cycle;
+		int32_t registers[32];
+		std::unordered_map<uint32_t, std::vector<uint32_t>> pre_images; // page -> contents when taken
+	};
+
+	time_travel(uint64_t interval = 1000000, size_t max_checkpoints = 4096)
+		: interval(interval ? interval : 1), max_checkpoints(max_checkpoints ? max_checkpoints : 1) {}
+
+	// Called before an instruction executes with the state it is about to change.
+	void record_instruction(uint32_t pc, uint64_t cycle, const int32_t* registers, uint32_t rd) {
+		if (checkpoints.empty() || (position % interval == 0 && checkpoints.back().position != position))
+			take_checkpoint(pc, cycle, registers);
+		log.push_back({ pc, cycle, registers[rd], 0, no_store, uint8_t(rd) });
+		position++;
+	}
+
+	// Called before a store overwrites `address` (a word index into data memory).
+	void record_store(const std::vector<uint32_t>& memory, uint32_t address) {
+		auto& record = log.back();
+		record.store_address = address;
+		record.old_word = memory[address];
+
+		uint32_t page = address >> page_shift;
+		auto& pre_images = checkpoints.back().pre_images;
+		if (!pre_images.contains(page)) {
+			auto begin = memory.begin() + (size_t(page) << page_shift);
+			auto end = memory.begin() + std::min(memory.size(), size_t(page + 1) << page_shift);
+			pre_images.emplace(page, std::vector<uint32_t>(begin, end));
+		}
+	}
+
+	// Undo the most recent instruction using the log. Only valid while
+	// position is past the newest checkpoint (see can_undo()).
+	void undo(int32_t* registers, uint32_t& pc, uint64_t& cycle, std::vector<uint32_t>& memory) {
+		auto& record = log.back();
+		if (record.store_address != no_store)
+			memory[record.store_address] = record.old_word;
+		registers[record.rd] = record.old_rd;
+		registers[0] = 0;
+		pc = record.pc;
+		cycle = record.cycle;
+		log.pop_back();
+		position--;
+	}
+
+	bool can_undo() const { return !log.empty(); }
+
+	// Rewind to the newest checkpoint taken at or before `target`. Later
+	// checkpoints are discarded, replay recreates them.
+	void restore(uint64_t target, int32_t* registers, uint32_t& pc, uint64_t& cycle, std::vector<uint32_t>& memory) {
+		while (checkpoints.size() > 1 && checkpoints.back().position > target) {
+			apply_pre_images(checkpoints.back(), memory);
+			checkpoints.pop_back();
+		}
+		auto& base = checkpoints.back();
+		apply_pre_images(base, memory);
+		base.pre_images.clear();
+		memcpy(registers, base.registers, sizeof(base.registers));
+		pc = base.pc;
+		cycle = base.cycle;
+		position = base.position;
+		log.clear();
+	}
+
+	// The state was changed from outside the guest (a debugger write), so
+	// nothing recorded so far replays or undoes into it. History restarts with
+	// a checkpoint of the state as it is now.
+	void rebase(uint32_t pc, uint64_t cycle, const int32_t* registers) {
+		checkpoints.clear();
+		take_checkpoint(pc, cycle, registers);
+	}
+
+	uint64_t get_position() const { return position; }
+	uint64_t oldest_position() const { return checkpoints.empty() ? position : checkpoints.front().position; }
+	uint64_t newest_checkpoint() const { return checkpoints.empty() ? position : checkpoints.back().position; }
+
+	// Position of the newest checkpoint strictly before `position`.
+	uint64_t checkpoint_before(uint64_t position) const {
+		for (auto it = checkpoints.rbegin(); it != checkpoints.rend(); ++it)
+			if (it->position < position) return it->position;
+		return oldest_position();
+	}
+
+private:
+	void take_checkpoint(uint32_t pc, uint64_t cycle, const int32_t* registers) {
+		if (checkpoints.size() == max_checkpoints)
+			checkpoints.pop_front(); // the oldest history is lost first
+		checkpoint cp;
+		cp.position = position;
+		cp.pc = pc;
+		cp.cycle = cycle;
+		memcpy(cp.registers, registers, sizeof(cp.registers));
+		checkpoints.push_back(std::move(cp));
+		log.clear();
+	}
+
+	static void apply_pre_images(const checkpoint& cp, std::vector<uint32_t>& memory) {
+		for (auto& [page, contents] : cp.pre_images)
+			std::copy(contents.begin(), contents.end(), memory.begin() + (size_t(page) << page_shift));
+	}
+
+	uint64_t interval;
+	size_t max_checkpoints;
+	uint64_t position = 0;
+	std::vector<undo_record> log;
+	std::deque<checkpoint> checkpoints;
+};
@@ -0,0 +1,252 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <stdexcept>
+#include "isa.h"
+#include "cpu_risc32i.h"
+#include "disassembler.h"
+#ifdef RISC_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Writes emulator.log from a background thread.
+//
+// The emulation thread only pushes a 16 byte record per instruction (cycle,
+// pc, fetched word and the value now in its rd) into a single producer,
+// single consumer ring and publishes it with one release store. The writer
+// thread keeps a copy of the register file, applies each record to it and
+// does all of the formatting, disassembly, compression and file I/O, so the
+// log comes out exactly as when it was written inline.
+//
+// When the ring is full the producer either waits for the writer (block, the
+// log is complete) or drops the record (drop, the guest never waits). After a
+// drop the next record that fits is preceded by a full register snapshot, so
+// the lines that do get written are still correct; only whole lines go missing.
+class trace_writer {
+public:
+	enum class backpressure { block, drop };
+
+	struct record {
+		uint32_t cycle;			// low 32 bits of the cycle count, the log's column wraps at 2^32
+		uint32_t pc;
+		uint32_t instruction;	// as fetched, a 16-bit parcel for RV32C
+		int32_t value;			// rd after the instruction retired
+	};
+
+	// Written by the producer or the writer alone, anyone may read them.
+	struct counters {
+		std::atomic<uint64_t> dropped{ 0 };		// lost to a full ring under drop
+		std::atomic<uint64_t> stalls{ 0 };		// times the producer found the ring full
+		alignas(64) std::atomic<uint64_t> lines{ 0 };	// written to the log
+		std::atomic<uint64_t> bytes{ 0 };		// of log text, before compression
+	};
+
+	static backpressure parse_backpressure(const std::string& name) {
+		if (name == "block") return backpressure::block;
+		if (name == "drop") return backpressure::drop;
+		throw std::runtime_error("Unknown -trace-backpressure '" + name + "' (block, drop are valid)");
+	}
+
+	// `registers` is the state before the first record. `capacity` is rounded
+	// up to a power of two. `dis`, when set, adds the disassembly column.
+	trace_writer(const std::string& path, const int32_t* registers, size_t capacity, backpressure mode, bool compress,
+		const disassembler* dis = nullptr) : mode(mode), dis(dis) {
+		size_t size = 16;
+		while (size < capacity) size <<= 1;
+		ring = std::make_unique<record[]>(size);
+		mask = size - 1;
+		memcpy(shadow, registers, sizeof(shadow));
+
+		if (compress) {
+#ifdef RISC_HAVE_ZLIB
+			gz = gzopen(path.c_str(), "wb1");
+			if (!gz)
+				throw std::runtime_error("Cannot write trace '" + path + "'");
+			gzbuffer(gz, 1 << 18);
+#else
+			throw std::runtime_error("-trace-compress needs an emulator built with zlib");
+#endif
+		}
+		else if (!(file = fopen(path.c_str(), "w")))
+			throw std::runtime_error("Cannot write trace '" + path + "'");
+		writer = std::thread([this] { drain(); });
+	}
+
+	~trace_writer() { close(); }
+
+	trace_writer(const trace_writer&) = delete;
+	trace_writer& operator=(const trace_writer&) = delete;
+
+	// Emulation thread only, after each cpu_risc32i::step(). Only the low 32
+	// bits of `cycle` are kept, so a record stays 16 bytes.
+	void push(uint64_t cycle, uint32_t pc, uint32_t instruction, const int32_t* registers) {
+		if (resync && !reserve(1 + snapshot_slots + 1))
+			return;
+		if (!resync && !reserve(1))
+			return;
+		if (resync) {
+			ring[produced++ & mask] = { uint32_t(cycle), snapshot, 0, 0 };
+			for (uint32_t i = 0; i < snapshot_slots; i++)
+				memcpy(&ring[produced++ & mask], registers + i * 4, sizeof(record));
+			resync = false;
+		}
+		uint32_t rd = !instruction ? 0 : (instruction & 0b11) == 0b11 ? isa::rd(instruction)
+			: isa::rd(cpu_risc32i::expand_compressed(uint16_t(instruction)));
+		ring[produced++ & mask] = { uint32_t(cycle), pc, instruction, registers[rd] };
+		head.store(produced, std::memory_order_release);
+	}
+
+	// Waits for everything pushed so far to reach the file.
+	void close() {
+		if (!writer.joinable()) return;
+		done.store(true, std::memory_order_release);
+		writer.join();
+		if (file) fclose(file);
+		file = nullptr;
+#ifdef RISC_HAVE_ZLIB
+		if (gz) gzclose(gz);
+		gz = nullptr;
+#endif
+	}
+
+	const counters& statistics() const { return stats; }
+
+	void report(FILE* out) const {
+		fprintf(out, "Trace: %llu lines, %llu bytes, %llu dropped, producer found the ring full %llu times\n",
+			(unsigned long long)stats.lines.load(), (unsigned long long)stats.bytes.load(),
+			(unsigned long long)stats.dropped.load(), (unsigned long long)stats.stalls.load());
+	}
+
+private:
+	static constexpr uint32_t snapshot = ~0u;	// pc of a marker followed by the whole register file
+	static constexpr uint32_t snapshot_slots = 32 * sizeof(int32_t) / sizeof(record);
+	static constexpr size_t buffer_size = 1 << 20;
+	static constexpr size_t disassembly_size = 256;	// given to dis->format(), at most 255 characters and a terminator
+	// "4294967295 (XXXXXXXX) " disassembly ":   " 32 registers of up to 8 digits and a space, '\n'
+	static constexpr size_t longest_line = 10 + 2 + 8 + 2 + (disassembly_size - 1) + 4 + 32 * 9 + 1;
+
+	// Makes room for `slots` records, false when they were dropped instead.
+	bool reserve(uint64_t slots) {
+		if (produced + slots - consumedCache <= mask + 1)
+			return true;
+		consumedCache = tail.load(std::memory_order_acquire);
+		if (produced + slots - consumedCache <= mask + 1)
+			return true;
+		stats.stalls.store(stats.stalls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (mode == backpressure::drop) {
+			stats.dropped.store(stats.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			resync = true;
+			return false;
+		}
+		while (produced + slots - (consumedCache = tail.load(std::memory_order_acquire)) > mask + 1)
+			std::this_thread::yield();
+		return true;
+	}
+
+	void drain() {
+		auto text = std::make_unique<char[]>(buffer_size);
+		char* at = text.get();
+		uint64_t consumed = 0;
+		for (;;) {
+			bool finished = done.load(std::memory_order_acquire);
+			uint64_t available = head.load(std::memory_order_acquire);
+			if (consumed == available) {
+				if (finished) break;
+				write(text.get(), at);
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+				continue;
+			}
+			while (consumed != available) {
+				const record& r = ring[consumed & mask];
+				if (r.pc == snapshot) {
+					for (uint32_t i = 0; i < snapshot_slots; i++)
+						memcpy(shadow + i * 4, &ring[(consumed + 1 + i) & mask], sizeof(record));
+					consumed += 1 + snapshot_slots;
+					continue;
+				}
+				at = line(at, r);
+				consumed++;
+				if (at + longest_line > text.get() + buffer_size) {
+					tail.store(consumed, std::memory_order_release);
+					write(text.get(), at);
+				}
+			}
+			tail.store(consumed, std::memory_order_release);
+		}
+		write(text.get(), at);
+	}
+
+	// "0001 (00C11FB3):   0 0 400 ..." as main() used to snprintf it
+	char* line(char* at, const record& r) {
+		uint32_t instruction = r.instruction;
+		if (instruction) {
+			uint32_t rd = (instruction & 0b11) == 0b11 ? isa::rd(instruction) : isa::rd(cpu_risc32i::expand_compressed(uint16_t(instruction)));
+			shadow[rd] = r.value;
+		}
+
+		char digits[16];
+		char* end = std::to_chars(digits, digits + sizeof(digits), r.cycle).ptr;
+		for (ptrdiff_t pad = 4 - (end - digits); pad > 0; pad--) *at++ = '0';
+		at = std::copy(digits, end, at);
+		*at++ = ' ';
+		*at++ = '(';
+		for (int i = 7; i >= 0; i--) *at++ = "0123456789ABCDEF"[(instruction >> (i * 4)) & 0xf];
+		*at++ = ')';
+		if (dis) {
+			*at++ = ' ';
+			size_t length = dis->format(instruction, r.pc, at, disassembly_size);
+			at += length;
+			for (; length < 32; length++) *at++ = ' ';
+		}
+		memcpy(at, ":   ", 4);
+		at += 4;
+		for (int i = 0; i < 32; i++) {
+			at = std::to_chars(at, at + 8, uint32_t(shadow[i]), 16).ptr;
+			*at++ = ' ';
+		}
+		*at++ = '\n';
+		stats.lines.store(stats.lines.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return at;
+	}
+
+	void write(char* start, char*& at) {
+		if (at == start) return;
+		size_t length = size_t(at - start);
+#ifdef RISC_HAVE_ZLIB
+		if (gz) gzwrite(gz, start, unsigned(length));
+#endif
+		if (file) fwrite(start, 1, length, file);
+		stats.bytes.store(stats.bytes.load(std::memory_order_relaxed) + length, std::memory_order_relaxed);
+		at = start;
+	}
+
+	// Producer's cache line
+	alignas(64) uint64_t produced = 0;
+	uint64_t consumedCache = 0;
+	bool resync = false;
+	backpressure mode;
+
+	alignas(64) std::atomic<uint64_t> head{ 0 };
+	alignas(64) std::atomic<uint64_t> tail{ 0 };
+	alignas(64) std::atomic<bool> done{ false };
+
+	// Writer's side
+	alignas(64) int32_t shadow[32];
+	std::unique_ptr<record[]> ring;
+	uint64_t mask = 0;
+	const disassembler* dis;
+	FILE* file = nullptr;
+#ifdef RISC_HAVE_ZLIB
+	gzFile gz = nullptr;
+#endif
+	counters stats;
+	std::thread writer;
+};
@@ -0,0 +1,479 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+#include "../risc-emulator/cpu_risc32i.h"
+#include "../risc-emulator/arguments.h"
+
+// splitmix64, so a seed means the same program on every platform and compiler
+// (the standard distributions are implementation defined).
+class random_stream {
+public:
+	explicit random_stream(uint64_t seed) : state(seed) {}
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	uint32_t below(uint32_t bound) { return bound ? uint32_t(next() % bound) : 0; }
+	bool chance(uint32_t percent) { return below(100) < percent; }
+
+	// Immediates lean on the values that break decoders: zero, +-1 and the
+	// extremes of the field.
+	int32_t immediate(int bits) {
+		int32_t min = -(1 << (bits - 1)), max = (1 << (bits - 1)) - 1;
+		switch (below(8)) {
+		case 0: return 0;
+		case 1: return 1;
+		case 2: return -1;
+		case 3: return min;
+		case 4: return max;
+		default: return int32_t(below(uint32_t(max - min) + 1)) + min;
+		}
+	}
+
+private:
+	uint64_t state;
+};
+
+// Random RV32I programs that run straight through: every jump and branch
+// goes forward inside the program, and a zero word at the end halts the cpu.
+//
+// CompileFile pads with nops when an instruction reads a register written by
+// one of the two instructions before it, because the pipeline does not
+// interlock. A nop is an empty word, which the emulator treats as a halt, so
+// the generator schedules registers to never need one instead: nothing reads
+// a register that either of its possible dynamic predecessors, or theirs,
+// wrote. The same stream is then valid for the RTL and the emulator alike.
+class program_generator {
+public:
+	std::vector<uint32_t> generate(uint64_t seed, uint32_t max_length) {
+		random_stream rng(seed);
+		uint32_t length = 8 + rng.below(std::max(max_length, 9u) - 8);
+		code.assign(length, 0);
+		written1.assign(length + 1, 0);
+		written2.assign(length + 1, 0);
+		for (uint32_t k = 0; k < length; k++)
+			code[k] = instruction(rng, k, length);
+		code.push_back(0); // halt
+		return code;
+	}
+
+private:
+	static uint32_t r_type(uint32_t funct7, uint32_t funct3, uint32_t rd, uint32_t rs1, uint32_t rs2) {
+		return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | cpu_risc32i::rtype;
+	}
+	static uint32_t i_type(uint32_t opcode, uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm) {
+		return (uint32_t(imm) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+	}
+	static uint32_t s_type(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+		return ((uint32_t(imm) >> 5) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((uint32_t(imm) & 0x1f) << 7) | cpu_risc32i::stype;
+	}
+	static uint32_t b_type(uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t offset) {
+		return (((offset >> 12) & 1) << 31) | (((offset >> 5) & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+			(((offset >> 1) & 0xf) << 8) | (((offset >> 11) & 1) << 7) | cpu_risc32i::btype;
+	}
+	static uint32_t j_type(uint32_t rd, uint32_t offset) {
+		return (((offset >> 20) & 1) << 31) | (((offset >> 1) & 0x3ff) << 21) | (((offset >> 11) & 1) << 20) | (offset & 0xff000) | (rd << 7) | cpu_risc32i::jal;
+	}
+
+	// Any register not written by a possible predecessor within two steps.
+	uint32_t source(random_stream& rng, uint32_t k) {
+		uint32_t forbidden = (written1[k] | written2[k]) & ~1u;
+		for (int tries = 0; tries < 8; tries++) {
+			uint32_t reg = rng.below(32);
+			if (!((forbidden >> reg) & 1)) return reg;
+		}
+		return 0;
+	}
+
+	// Forward target in [k + 1, length], the halt included.
+	uint32_t target(random_stream& rng, uint32_t k, uint32_t length) {
+		return k + 1 + rng.below(std::min(length - k, 64u));
+	}
+
+	void jump_to(uint32_t k, uint32_t target, uint32_t rd) {
+		written1[target] |= rd ? 1u << rd : 0;
+		written2[target] |= written1[k];
+	}
+
+	uint32_t instruction(random_stream& rng, uint32_t k, uint32_t length) {
+		uint32_t rd = rng.chance(5) ? 0 : rng.below(32);
+		bool falls_through = true;
+		uint32_t word = 0, writes = rd;
+
+		switch (rng.below(16)) {
+		case 0:
+			word = (uint32_t(rng.immediate(20)) << 12) | (rd << 7) | (rng.chance(50) ? cpu_risc32i::lui : cpu_risc32i::aupic);
+			break;
+		case 1: {
+			static const uint32_t widths[] = { 0b000, 0b001, 0b010, 0b100, 0b101 };
+			word = i_type(cpu_risc32i::itype_mem, widths[rng.below(5)], rd, source(rng, k), rng.immediate(12));
+			break;
+		}
+		case 2:
+			word = s_type(rng.below(3), source(rng, k), source(rng, k), rng.immediate(12));
+			writes = 0;
+			break;
+		case 3: case 4: {
+			static const uint32_t conditions[] = { 0b000, 0b001, 0b100, 0b101, 0b110, 0b111 };
+			uint32_t to = target(rng, k, length);
+			word = b_type(conditions[rng.below(6)], source(rng, k), source(rng, k), (to - k) * 4);
+			jump_to(k, to, 0);
+			writes = 0;
+			break;
+		}
+		case 5: {
+			uint32_t to = target(rng, k, length);
+			if (rng.chance(30) && to * 4 < 2048) {
+				word = i_type(cpu_risc32i::jalr, 0, rd, 0, int32_t(to * 4)); // absolute, through x0
+			}
+			else word = j_type(rd, (to - k) * 4);
+			jump_to(k, to, rd);
+			falls_through = false;
+			break;
+		}
+		case 6: case 7: case 8: case 9: {
+			uint32_t funct3 = rng.below(8);
+			int32_t imm = rng.immediate(12);
+			if (funct3 == 0b001) imm = rng.below(32);
+			if (funct3 == 0b101) imm = rng.below(32) | (rng.chance(50) ? 0x400 : 0); // srli / srai
+			word = i_type(cpu_risc32i::itype, funct3, rd, source(rng, k), imm);
+			break;
+		}
+		default: {
+			uint32_t funct3 = rng.below(8);
+			uint32_t funct7 = (funct3 == 0b000 || funct3 == 0b101) && rng.chance(50) ? 0b0100000 : 0;
+			word = r_type(funct7, funct3, rd, source(rng, k), source(rng, k));
+			break;
+		}
+		}
+
+		if (falls_through) {
+			written1[k + 1] |= writes ? 1u << writes : 0;
+			written2[k + 1] |= written1[k];
+		}
+		return word;
+	}
+
+	std::vector<uint32_t> code;
+	std::vector<uint32_t> written1;	// per position, registers its possible predecessors wrote
+	std::vector<uint32_t> written2;	// and what theirs wrote
+};
+
+// Independent, deliberately plain RV32I model with the emulator's memory
+// conventions: instructions at pc >> 2, data words indexed by address modulo
+// the memory size, sub-word stores replacing the low bits of a word.
+struct reference_model {
+	int32_t x[32] = {};
+	uint32_t pc = 0;
+	std::vector<uint32_t> program;
+	std::vector<uint32_t> data;
+
+	struct retired {
+		uint32_t pc;
+		uint32_t instruction;
+		uint8_t rd;				// 0 when nothing was written
+		uint32_t value;
+		bool store;
+		uint32_t address;		// word index
+		uint32_t stored;		// whole word after the store
+	};
+
+	// Returns false on the halt word.
+	bool step(retired& out) {
+		uint32_t in = program[(pc >> 2) % program.size()];
+		if (!in) return false;
+		uint32_t op = in & 0x7f, rd = (in >> 7) & 0x1f, f3 = (in >> 12) & 7, rs1 = (in >> 15) & 0x1f, rs2 = (in >> 20) & 0x1f, f7 = in >> 25;
+		int32_t imm_i = int32_t(in) >> 20;
+		int32_t imm_s = (int32_t(in) >> 25 << 5) | int32_t(rd);
+		int32_t imm_b = (int32_t(in) >> 31 << 12) | int32_t(((in >> 7) & 1) << 11) | int32_t(((in >> 25) & 0x3f) << 5) | int32_t(((in >> 8) & 0xf) << 1);
+		int32_t imm_j = (int32_t(in) >> 31 << 20) | int32_t(in & 0xff000) | int32_t(((in >> 20) & 1) << 11) | int32_t(((in >> 21) & 0x3ff) << 1);
+		uint32_t a = uint32_t(x[rs1]), b = uint32_t(x[rs2]);
+		uint32_t next = pc + 4, value = 0;
+		bool writes = false;
+		out = { pc, in, 0, 0, false, 0, 0 };
+
+		switch (op) {
+		case cpu_risc32i::lui: value = in & 0xfffff000; writes = true; break;
+		case cpu_risc32i::aupic: value = pc + (in & 0xfffff000); writes = true; break;
+		case cpu_risc32i::jal: value = pc + 4; writes = true; next = (pc + imm_j) & ~1u; break;
+		case cpu_risc32i::jalr: value = pc + 4; writes = true; next = (a + imm_i) & ~1u; break;
+		case cpu_risc32i::btype: {
+			bool taken = f3 == 0 ? a == b : f3 == 1 ? a != b : f3 == 4 ? int32_t(a) < int32_t(b) :
+				f3 == 5 ? int32_t(a) >= int32_t(b) : f3 == 6 ? a < b : a >= b;
+			if (taken) next = pc + imm_b;
+			break;
+		}
+		case cpu_risc32i::itype_mem: {
+			uint32_t word = data[(a + imm_i) % data.size()];
+			value = f3 == 0 ? uint32_t(int8_t(word)) : f3 == 1 ? uint32_t(int16_t(word)) : f3 == 4 ? word & 0xff : f3 == 5 ? word & 0xffff : word;
+			writes = true;
+			break;
+		}
+		case cpu_risc32i::stype: {
+			uint32_t index = (a + imm_s) % data.size();
+			uint32_t mask = f3 == 0 ? 0xff : f3 == 1 ? 0xffff : 0xffffffff;
+			data[index] = (data[index] & ~mask) | (b & mask);
+			out.store = true;
+			out.address = index;
+			out.stored = data[index];
+			break;
+		}
+		case cpu_risc32i::itype:
+		case cpu_risc32i::rtype: {
+			uint32_t rhs = op == cpu_risc32i::itype ? uint32_t(imm_i) : b;
+			bool alternate = op == cpu_risc32i::rtype ? f7 == 0b0100000 : (f3 == 5 && (in >> 30) & 1);
+			switch (f3) {
+			case 0: value = op == cpu_risc32i::rtype && alternate ? a - rhs : a + rhs; break;
+			case 1: value = a << (rhs & 31); break;
+			case 2: value = int32_t(a) < int32_t(rhs); break;
+			case 3: value = a < rhs; break;
+			case 4: value = a ^ rhs; break;
+			case 5: value = alternate ? uint32_t(int32_t(a) >> (rhs & 31)) : a >> (rhs & 31); break;
+			case 6: value = a | rhs; break;
+			case 7: value = a & rhs; break;
+			}
+			writes = true;
+			break;
+		}
+		default:
+			throw std::runtime_error("reference model: unknown opcode");
+		}
+
+		if (writes && rd) {
+			x[rd] = int32_t(value);
+			out.rd = uint8_t(rd);
+			out.value = value;
+		}
+		pc = next;
+		return true;
+	}
+};
+
+// The cpu under test with access to its memories for the comparison.
+class cpu_under_test : public cpu_risc32i {
+public:
+	using cpu_risc32i::cpu_risc32i;
+	uint32_t data_word(uint32_t index) const { return isolated_memory[index]; }
+};
+
+struct fuzz_result {
+	uint64_t seed = 0;
+	uint64_t steps = 0;
+	std::string failure;					// empty when the cpu agreed with the model
+	bool interesting = false;				// reached a feature no earlier seed had
+	std::vector<uint32_t> program;
+	std::vector<reference_model::retired> trace;
+};
+
+// Coarse features a run can reach: every encoding class with its branch
+// direction, and a few result classes per class.
+uint32_t feature(uint32_t instruction, uint32_t detail) {
+	uint32_t op = instruction & 0x7f, f3 = (instruction >> 12) & 7, alt = (instruction >> 30) & 1;
+	return ((op * 8 + f3) * 2 + alt) * 8 + detail;
+}
+
+fuzz_result fuzz(uint64_t seed, uint32_t max_length, uint32_t memory_words, bool keep_trace, std::vector<uint8_t>* features,
+	instruction_coverage* coverage = nullptr) {
+	program_generator generator;
+	fuzz_result result;
+	result.seed = seed;
+	result.program = generator.generate(seed, max_length);
+
+	cpu_under_test cpu(memory_words);
+	cpu.load_program(0, result.program);
+	cpu.coverage = coverage;
+
+	reference_model model;
+	model.program = cpu.program_memory();
+	model.data = cpu.data_memory();
+	memcpy(model.x, cpu.registers.REG, sizeof(model.x));
+
+	char failure[160];
+	reference_model::retired retired{};
+	// Control flow only goes forward, so a program that is still running
+	// after one step per word has looped and is a generator bug.
+	uint64_t budget = result.program.size() + 1;
+	try {
+		for (; budget; budget--) {
+			bool running = model.step(retired);
+			bool cpu_running = cpu.step() != 0;
+			if (running != cpu_running) {
+				snprintf(failure, sizeof(failure), "model %s, cpu %s at pc 0x%08X", running ? "ran" : "halted", cpu_running ? "ran" : "halted", model.pc);
+				result.failure = failure;
+				break;
+			}
+			if (!running) break;
+			result.steps++;
+			if (keep_trace) result.trace.push_back(retired);
+
+			if (features) {
+				uint32_t detail = retired.rd ? (retired.value == 0 ? 1 : int32_t(retired.value) < 0 ? 2 : 3) : 0;
+				if ((retired.instruction & 0x7f) == cpu_risc32i::btype) detail = model.pc != retired.pc + 4 ? 4 : 5;
+				uint32_t f = feature(retired.instruction, detail);
+				if (f < features->size()) (*features)[f] = 1;
+			}
+
+			if (cpu.get_pc() != model.pc) {
+				snprintf(failure, sizeof(failure), "pc 0x%08X after 0x%08X, model has 0x%08X", cpu.get_pc(), retired.instruction, model.pc);
+				result.failure = failure;
+				break;
+			}
+			for (int i = 0; i < 32 && result.failure.empty(); i++) {
+				if (cpu.registers.REG[i] == model.x[i]) continue;
+				snprintf(failure, sizeof(failure), "x%d = 0x%08X after 0x%08X at pc 0x%08X, model has 0x%08X", i, uint32_t(cpu.registers.REG[i]),
+					retired.instruction, retired.pc, uint32_t(model.x[i]));
+				result.failure = failure;
+			}
+			if (result.failure.empty() && retired.store && cpu.data_word(retired.address) != retired.stored) {
+				snprintf(failure, sizeof(failure), "mem[0x%X] = 0x%08X after 0x%08X at pc 0x%08X, model has 0x%08X", retired.address,
+					cpu.data_word(retired.address), retired.instruction, retired.pc, retired.stored);
+				result.failure = failure;
+			}
+			if (!result.failure.empty()) break;
+		}
+		if (!budget) {
+			snprintf(failure, sizeof(failure), "did not halt within %llu steps, pc 0x%08X", (unsigned long long)result.steps, model.pc);
+			result.failure = failure;
+		}
+	}
+	catch (const std::exception& e) {
+		snprintf(failure, sizeof(failure), "threw '%s' at pc 0x%08X", e.what(), retired.pc);
+		result.failure = failure;
+	}
+	return result;
+}
+
+// <seed>.hex loads into the emulator (-i) as is, <seed>.trace is what the
+// model retired, one line per instruction:
+//   pc insn [xN=value] [mem[index]=word]
+void write_seed(const std::filesystem::path& directory, const fuzz_result& result) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)result.seed);
+	std::ofstream hex(directory / (std::string(name) + ".hex"));
+	char line[96];
+	for (auto word : result.program) {
+		snprintf(line, sizeof(line), "%08x\n", word);
+		hex << line;
+	}
+
+	std::ofstream trace(directory / (std::string(name) + ".trace"));
+	trace << "# seed " << name << ", " << result.steps << " instructions";
+	if (!result.failure.empty()) trace << ", FAIL: " << result.failure;
+	trace << "\n";
+	for (auto& r : result.trace) {
+		int n = snprintf(line, sizeof(line), "%08x %08x", r.pc, r.instruction);
+		if (r.rd) n += snprintf(line + n, sizeof(line) - n, " x%u=%08x", r.rd, r.value);
+		if (r.store) n += snprintf(line + n, sizeof(line) - n, " mem[%x]=%08x", r.address, r.stored);
+		trace << line << '\n';
+	}
+}
+
+int main(int argc, char** argv) {
+
+	auto args = ProccessArguments(argc, argv, {
+		std::make_pair("-seed", ArgOpt{std::string("1")}),			// first seed
+		std::make_pair("-count", ArgOpt{std::string("100000")}),	// programs to run
+		std::make_pair("-length", ArgOpt{std::string("256")}),		// longest program, in instructions
+		std::make_pair("-mem", ArgOpt{std::string("4096")}),		// words of guest memory
+		std::make_pair("-jobs", ArgOpt{std::string("0")}),			// host threads, 0 = one per core
+		std::make_pair("-o", ArgOpt{std::string("fuzz-out")}),		// where failing and interesting seeds go
+		std::make_pair("-interesting", ArgOpt{std::string("1")}),	// also keep seeds that reach new features
+		std::make_pair("-replay", ArgOpt{}),						// write one seed's program and trace and exit
+		std::make_pair("-coverage", ArgOpt{}),						// encoding coverage file, merged into when it exists
+	});
+
+	uint32_t max_length = std::max(8ul, std::stoul(args["-length"]));
+	uint32_t memory_words = std::stoul(args["-mem"]);
+	std::filesystem::path directory = args["-o"];
+	std::filesystem::create_directories(directory);
+
+	if (!args["-replay"].empty()) {
+		auto result = fuzz(std::stoull(args["-replay"], nullptr, 0), max_length, memory_words, true, nullptr);
+		write_seed(directory, result);
+		printf("seed %s: %llu instructions, %s\n", args["-replay"].c_str(), (unsigned long long)result.steps,
+			result.failure.empty() ? "pass" : result.failure.c_str());
+		return result.failure.empty() ? 0 : 1;
+	}
+
+	uint64_t first = std::stoull(args["-seed"], nullptr, 0);
+	uint64_t count = std::stoull(args["-count"]);
+	uint32_t jobs = std::stoul(args["-jobs"]);
+	if (!jobs) jobs = std::max(1u, std::thread::hardware_concurrency());
+	bool keep_interesting = args["-interesting"] != "0";
+
+	std::mutex lock;
+	std::vector<uint8_t> seen(1 << 14, 0);	// features reached by any earlier seed
+	bool track_coverage = !args["-coverage"].empty();
+	instruction_coverage coverage;			// encodings reached by any earlier seed
+	std::atomic<uint64_t> next{ 0 }, instructions{ 0 }, failures{ 0 }, interesting{ 0 };
+
+	auto start = std::chrono::steady_clock::now();
+	auto worker = [&] {
+		std::vector<uint8_t> features(seen.size());
+		instruction_coverage local;	// only merged when it gained bits, which stops happening early
+		for (uint64_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+			std::fill(features.begin(), features.end(), 0);
+			uint64_t local_bits = local.new_bits;
+			auto result = fuzz(first + i, max_length, memory_words, false, keep_interesting ? &features : nullptr,
+				track_coverage ? &local : nullptr);
+			instructions.fetch_add(result.steps, std::memory_order_relaxed);
+
+			bool fresh = false;
+			if (keep_interesting) {
+				std::lock_guard<std::mutex> guard(lock);
+				for (size_t f = 0; f < features.size(); f++)
+					if (features[f] && !seen[f]) seen[f] = 1, fresh = true;
+			}
+			if (local.new_bits != local_bits) {
+				std::lock_guard<std::mutex> guard(lock);
+				fresh |= coverage.merge(local) != 0 && keep_interesting;
+			}
+			if (result.failure.empty() && !fresh) continue;
+
+			// rerun with the trace only for the few seeds worth keeping
+			result = fuzz(first + i, max_length, memory_words, true, nullptr);
+			result.interesting = fresh;
+			(result.failure.empty() ? interesting : failures).fetch_add(1);
+			std::lock_guard<std::mutex> guard(lock);
+			write_seed(directory, result);
+			printf("%016llx  %s\n", (unsigned long long)result.seed, result.failure.empty() ? "new coverage" : result.failure.c_str());
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (uint32_t j = 0; j < jobs; j++)
+		threads.emplace_back(worker);
+	for (auto& thread : threads)
+		thread.join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("\n%llu programs, %llu instructions in %.2fs (%.0f programs/hour, %.2f MIPS on %u threads)\n", (unsigned long long)count,
+		(unsigned long long)instructions.load(), seconds, seconds > 0 ? count / seconds * 3600 : 0.0,
+		seconds > 0 ? instructions.load() / seconds / 1e6 : 0.0, jobs);
+	printf("%llu failing, %llu interesting seeds written to %s\n", (unsigned long long)failures.load(),
+		(unsigned long long)interesting.load(), directory.string().c_str());
+	if (track_coverage) {
+		try {
+			coverage.accumulate(args["-coverage"]);
+			coverage.summary(stdout);
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "ERROR: %s\n", e.what());
+			return 1;
+		}
+	}
+	return failures.load() ? 1 : 0;
+}